@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+# 根据 Python 自带的 Unicode 数据生成 unicode_width.h 中的显示宽度表
+#   python3 gen_width.py > unicode_width.h
+import unicodedata
+import sys
+
+
+def ranges(pred):
+    out = []
+    for cp in range(0x80, 0x110000):
+        if not pred(cp):
+            continue
+        if out and out[-1][1] == cp - 1:
+            out[-1][1] = cp
+        else:
+            out.append([cp, cp])
+    return out
+
+
+def zero(cp):
+    # 组合字符、格式控制字符 (软连字符除外) 和韩文字母的中声、终声不占位置
+    if cp == 0xAD:
+        return False
+    if 0x1160 <= cp <= 0x11FF or cp == 0x200B:
+        return True
+    return unicodedata.category(chr(cp)) in ("Mn", "Me", "Cf")
+
+
+def wide(cp):
+    return unicodedata.east_asian_width(chr(cp)) in ("W", "F") and not zero(cp)
+
+
+def table(name, rs):
+    print("const unsigned int %s[][2] = {" % name)
+    line = "   "
+    for lo, hi in rs:
+        item = " {0x%04X, 0x%04X}," % (lo, hi)
+        if len(line) + len(item) > 100:
+            print(line)
+            line = "   "
+        line += item
+    print(line)
+    print("};")
+
+
+print("// 由 gen_width.py 根据 Unicode %s 生成, 不要手动修改" % unicodedata.unidata_version)
+print()
+print("// 显示宽度为 0 的字符")
+table("widthZero", ranges(zero))
+print()
+print("// 显示宽度为 2 的东亚宽字符")
+table("widthWide", ranges(wide))
@@ -0,0 +1,335 @@
+/*
+行操作的微基准测试, 与 --bench 的整体回放互补。
+对每种行长度、行数和制表符比例的组合, 分别测量 editorInsertRow、editorDelRow、
+editorRowInsertChar、editorRowDelChar、EditorRowApendString、editorUpdateRow、
+editorRowsToString 和 editorOpen 的耗时与内存分配次数, 结果以 CSV 或 JSON 输出,
+用于比较不同版本之间的差异。
+
+    make microbench                      # CSV
+    ./qeditor_microbench --json          # JSON
+    ./qeditor_microbench --quick         # 只跑较小的组合
+
+编辑器本身以 -DQEDITOR_BENCH 编译进来, 所以可以统计内存分配次数。撤销日志在测试期间
+关闭, 只测量行这一层。
+*/
+#define main qeditorMain
+#include "qeditor.c"
+#undef main
+
+#define MB_REPEAT 3      // 每项重复的次数, 取最快的一次
+#define MB_EDITS 100000  // 行内插入和删除的次数
+#define MB_APPENDS 10000 // 追加字符串的次数
+
+// 一种测试组合
+typedef struct mbcase
+{
+    int lines;
+    int linelen;
+    int tabs; // 制表符占字符的百分比
+} mbcase;
+
+// 一项测量结果
+typedef struct mbresult
+{
+    const char *op;
+    long long ops;
+    double ns;     // 每次操作的纳秒数
+    double allocs; // 每次操作的内存分配次数
+} mbresult;
+
+unsigned int mbSeed;
+
+// 固定种子的伪随机数, 不同版本之间的操作序列相同
+unsigned int mbRand()
+{
+    mbSeed ^= mbSeed << 13;
+    mbSeed ^= mbSeed >> 17;
+    mbSeed ^= mbSeed << 5;
+    return mbSeed;
+}
+
+// 按组合生成一行内容
+void mbLine(mbcase *c, char *buf)
+{
+    int j;
+    for (j = 0; j < c->linelen; j++)
+        buf[j] = (int)(mbRand() % 100) < c->tabs ? '\t' : 'a' + mbRand() % 26;
+}
+
+// 清空缓冲区
+void mbReset()
+{
+    while (E.numrows > 0)
+        editorDelRow(E.numrows - 1);
+    E.cx = E.cy = E.rowoff = E.coloff = 0;
+}
+
+// 按组合填充缓冲区
+void mbFill(mbcase *c, char *buf)
+{
+    int i;
+    mbReset();
+    for (i = 0; i < c->lines; i++)
+    {
+        mbLine(c, buf);
+        editorInsertRow(E.numrows, buf, c->linelen);
+    }
+}
+
+// 把组合对应的文件写到 path
+void mbWriteFile(mbcase *c, char *buf, const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        die(path);
+    int i;
+    for (i = 0; i < c->lines; i++)
+    {
+        mbLine(c, buf);
+        fwrite(buf, 1, c->linelen, fp);
+        fputc('\n', fp);
+    }
+    fclose(fp);
+}
+
+// 关闭映射的文件, 为下一次 editorOpen 做准备
+void mbClose()
+{
+    mbReset();
+    if (E.map)
+    {
+        munmap(E.map, E.mapsize);
+        E.map = NULL;
+        E.mapsize = 0;
+    }
+}
+
+// 执行一项测量, 每次重复前由 setup 准备状态, run 返回执行的操作次数
+void mbMeasure(mbcase *c, char *buf, const char *op, void (*setup)(mbcase *, char *),
+               long long (*run)(mbcase *, char *), mbresult *r)
+{
+    int k;
+    r->op = op;
+    r->ns = -1;
+    for (k = 0; k < MB_REPEAT; k++)
+    {
+        mbSeed = 2463534242u;
+        if (setup)
+            setup(c, buf);
+        long allocs = benchAllocCount();
+        long long start = editorNowNs();
+        long long ops = run(c, buf);
+        long long ns = editorNowNs() - start;
+        allocs = benchAllocCount() - allocs;
+        if (r->ns < 0 || (double)ns / ops < r->ns)
+        {
+            r->ops = ops;
+            r->ns = (double)ns / ops;
+            r->allocs = (double)allocs / ops;
+        }
+    }
+}
+
+/* 各项测量 */
+
+void mbSetupEmpty(mbcase *c, char *buf)
+{
+    (void)c;
+    (void)buf;
+    mbReset();
+}
+
+void mbSetupFill(mbcase *c, char *buf)
+{
+    mbFill(c, buf);
+}
+
+long long mbInsertRow(mbcase *c, char *buf)
+{
+    mbLine(c, buf);
+    int i;
+    for (i = 0; i < c->lines; i++)
+        editorInsertRow(mbRand() % (E.numrows + 1), buf, c->linelen);
+    return c->lines;
+}
+
+long long mbDelRow(mbcase *c, char *buf)
+{
+    (void)buf;
+    int i;
+    for (i = 0; i < c->lines; i++)
+        editorDelRow(mbRand() % E.numrows);
+    return c->lines;
+}
+
+long long mbInsertChar(mbcase *c, char *buf)
+{
+    (void)c;
+    (void)buf;
+    int i;
+    for (i = 0; i < MB_EDITS; i++)
+    {
+        erow *row = editorRow(mbRand() % E.numrows);
+        editorRowInsertChar(row, mbRand() % (row->size + 1), 'a' + i % 26);
+    }
+    return MB_EDITS;
+}
+
+long long mbDelChar(mbcase *c, char *buf)
+{
+    (void)c;
+    (void)buf;
+    long long ops = 0;
+    int i;
+    for (i = 0; i < MB_EDITS; i++)
+    {
+        erow *row = editorRow(mbRand() % E.numrows);
+        if (row->size == 0)
+            continue;
+        editorRowDelChar(row, mbRand() % row->size);
+        ops++;
+    }
+    return ops ? ops : 1;
+}
+
+long long mbAppendString(mbcase *c, char *buf)
+{
+    int len = c->linelen < 64 ? c->linelen : 64;
+    mbLine(c, buf);
+    int i;
+    for (i = 0; i < MB_APPENDS; i++)
+        EditorRowApendString(editorRow(mbRand() % E.numrows), buf, len);
+    return MB_APPENDS;
+}
+
+// 渲染推迟到显示时, 所以连同 editorRowRender 一起测量
+long long mbUpdateRow(mbcase *c, char *buf)
+{
+    (void)buf;
+    int i;
+    for (i = 0; i < c->lines; i++)
+    {
+        erow *row = editorRow(mbRand() % E.numrows);
+        editorUpdateRow(row);
+        editorRowRender(row);
+    }
+    return c->lines;
+}
+
+long long mbRowsToString(mbcase *c, char *buf)
+{
+    (void)c;
+    (void)buf;
+    size_t len;
+    free(editorRowsToString(&len));
+    return 1;
+}
+
+char mbPath[] = "/tmp/qeditor_microbench.XXXXXX";
+
+void mbSetupFile(mbcase *c, char *buf)
+{
+    mbClose();
+    mbWriteFile(c, buf, mbPath);
+}
+
+// 打开文件并建立全部行索引
+long long mbOpen(mbcase *c, char *buf)
+{
+    (void)c;
+    (void)buf;
+    editorOpen(mbPath);
+    editorLoadAll();
+    return 1;
+}
+
+void mbPrint(mbcase *c, mbresult *r, int json, int *first)
+{
+    if (json)
+    {
+        printf("%s\n  {\"op\": \"%s\", \"lines\": %d, \"linelen\": %d, \"tabs\": %d, "
+               "\"ops\": %lld, \"ns_per_op\": %.1f, \"allocs_per_op\": %.3f}",
+               *first ? "" : ",", r->op, c->lines, c->linelen, c->tabs, r->ops, r->ns, r->allocs);
+    }
+    else
+    {
+        printf("%s,%d,%d,%d,%lld,%.1f,%.3f\n", r->op, c->lines, c->linelen, c->tabs,
+               r->ops, r->ns, r->allocs);
+    }
+    *first = 0;
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    int json = 0, quick = 0;
+    int i;
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--json"))
+            json = 1;
+        else if (!strcmp(argv[i], "--quick"))
+            quick = 1;
+        else
+        {
+            fprintf(stderr, "usage: %s [--json] [--quick]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    E.headless = 1;
+    E.infd = -1;
+    E.recordfd = -1;
+    E.screenrows = QEDITOR_BENCH_ROWS;
+    E.screencols = QEDITOR_BENCH_COLS;
+    initEditor();
+    E.undo.suspend++;
+    int fd = mkstemp(mbPath);
+    if (fd == -1)
+        die("mkstemp");
+    close(fd);
+
+    int lines[] = {1000, 100000};
+    int linelens[] = {8, 80, 1000};
+    int tabs[] = {0, 10};
+    int nlines = quick ? 1 : 2;
+    char *buf = malloc(linelens[2] > 64 ? linelens[2] : 64);
+
+    int first = 1;
+    if (json)
+        printf("[");
+    else
+        printf("op,lines,linelen,tabs,ops,ns_per_op,allocs_per_op\n");
+
+    int a, b, t;
+    for (a = 0; a < nlines; a++)
+        for (b = 0; b < 3; b++)
+            for (t = 0; t < 2; t++)
+            {
+                mbcase c = {lines[a], linelens[b], tabs[t]};
+                mbresult r;
+                mbMeasure(&c, buf, "editorInsertRow", mbSetupEmpty, mbInsertRow, &r);
+                mbPrint(&c, &r, json, &first);
+                mbMeasure(&c, buf, "editorDelRow", mbSetupFill, mbDelRow, &r);
+                mbPrint(&c, &r, json, &first);
+                mbMeasure(&c, buf, "editorRowInsertChar", mbSetupFill, mbInsertChar, &r);
+                mbPrint(&c, &r, json, &first);
+                mbMeasure(&c, buf, "editorRowDelChar", mbSetupFill, mbDelChar, &r);
+                mbPrint(&c, &r, json, &first);
+                mbMeasure(&c, buf, "EditorRowApendString", mbSetupFill, mbAppendString, &r);
+                mbPrint(&c, &r, json, &first);
+                mbMeasure(&c, buf, "editorUpdateRow", mbSetupFill, mbUpdateRow, &r);
+                mbPrint(&c, &r, json, &first);
+                mbMeasure(&c, buf, "editorRowsToString", mbSetupFill, mbRowsToString, &r);
+                mbPrint(&c, &r, json, &first);
+                mbMeasure(&c, buf, "editorOpen", mbSetupFile, mbOpen, &r);
+                mbPrint(&c, &r, json, &first);
+                mbClose();
+            }
+    if (json)
+        printf("\n]\n");
+
+    unlink(mbPath);
+    free(buf);
+    return 0;
+}
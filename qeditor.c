@@ -15,13 +15,52 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <libgen.h>
+#include <signal.h>
+#include "unicode_width.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QEDITOR_X86 1
+#endif
 
 /******************** defines ********************/
 #define QEDITOR_VERSION "0.0.1"
 #define QEDITOR_TAB_STOP 8
 #define QEDITOR_QUIT_TIMES 3
+#define QEDITOR_LOAD_CHUNK 1024 // 载入线程交出的第一批行数, 足够显示首屏
+#define QEDITOR_LOAD_BATCH 65536 // 之后每批的行数
+#define QEDITOR_LOAD_BLOCK (1 << 20) // 不能映射的文件每次读取的大小, 第一次读 1/16
+#define QEDITOR_FOLLOW_READ (16 << 20) // 跟随文件时每轮最多读入的新内容
+#define QEDITOR_WATCH_POLL 500        // 没有 inotify 时检查文件变化的间隔 (毫秒)
+#define QEDITOR_RELOAD_SYNC 4         // 重新载入时连续这么多行相同才算重新对齐
+#define ROPE_BLOCK_ROWS 64       // 行树中每个块最多容纳的行数
+#define QEDITOR_PASTE_MAX (16 << 20) // 粘贴时每次最多交出的字节数
+#define QEDITOR_PASTE_WAIT 2000      // 粘贴中超过这么久 (毫秒) 没有输入就不再等结束标记
+#define QEDITOR_RENDER_CACHE 256 // 渲染缓存至少容纳的行数
+#define QEDITOR_SEARCH_RUN 4096  // 查找时合并成一段扫描的最大行数
+#define QEDITOR_SEARCH_CHUNK 16384 // 后台查找时每个任务块的行数
+#define QEDITOR_SEARCH_THREADS 8   // 后台查找的最大线程数
+#define QEDITOR_SAVE_IOV 1024      // 保存时每次 writev 最多提交的片段数
+#define QEDITOR_UNDO_LIMIT (4 << 20) // 撤销日志默认的内存上限, 可用环境变量 QEDITOR_UNDO_LIMIT 修改
+#define QEDITOR_COL_STEP 4096        // 长行中列映射检查点的间隔
+#define QEDITOR_COL_ROWS 8           // 保存列映射检查点的长行数
+#define ROW_SLAB_CLASSES 10           // 小块内存的大小级别数
+#define ROW_SLAB_PAGE (64 << 10)      // 切分小块的页大小
+#define ROW_ARENA_CHUNK (1 << 20)     // 载入文本时每次申请的 arena 大小
+#define QEDITOR_BENCH_ROWS 24         // 无终端回放时默认的虚拟终端大小
+#define QEDITOR_BENCH_COLS 80
+#define QEDITOR_PROF_ROWS 3           // 性能信息覆盖在文本区域底部的行数
 
 #define CTRL_KEY(k) ((k)&0x1f)
+// 按逻辑下标读取行中的字符, 跳过间隙缓冲区的间隙
+#define ROWCHAR(row, i) ((row)->chars[(i) < (row)->gap ? (i) : (i) + editorRowGapLen(row)])
 
 enum editorKey
 {
@@ -34,43 +73,482 @@ enum editorKey
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    BG_EVENT,  // 不是按键: 后台任务有了新的结果, 需要刷新屏幕
+    PASTE_TEXT // 不是按键: 括号粘贴模式下粘贴的文本, 内容在 E.paste 中
 };
 
+// 撤销日志的记录类型, 相邻的两种互为逆操作
+enum undoType
+{
+    UNDO_INSERT, // 在行中插入文本
+    UNDO_DELETE, // 从行中删除文本
+    UNDO_INSROW, // 插入一行
+    UNDO_DELROW  // 删除一行
+};
+
+// 定时器, 到期时刷新屏幕
+enum editorTimer
+{
+    TIMER_STATUSMSG, // 状态消息显示 5 秒后消失
+    TIMER_WATCH,     // 没有 inotify 时定期检查打开的文件
+    QEDITOR_TIMERS
+};
+
+enum rowFlags
+{
+    ROW_MAPPED = 1,  // chars 指向文件映射区或载入时的 arena, 不属于这一行, 修改前需要先复制
+    ROW_PLAIN = 2,    // 不含制表符, 直接用 chars 显示
+    ROW_RENDERED = 4, // 渲染缓存中的内容有效
+    ROW_ASCII = 8     // 只含 ASCII 字符, 每个字节占一列
+};
+
+// 高亮类型, 每种对应一种颜色
+enum editorHighlight
+{
+    HL_NORMAL = 0,
+    HL_COMMENT,
+    HL_MLCOMMENT,
+    HL_KEYWORD1,
+    HL_KEYWORD2,
+    HL_STRING,
+    HL_NUMBER
+};
+
+// 行末的词法状态, 是下一行开始时的状态
+enum hlState
+{
+    HLS_NORMAL = 0,
+    HLS_COMMENT = 1,    // 在多行注释中
+    HLS_UNKNOWN = 0xff  // 还没有计算过
+};
+
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
 /******************** data********************/
 // 一个用于存储一行文本的数据类型
 typedef struct erow
 {
-    int size;
-    int rsize;
+    long long size;
+    long long rsize;
     char *chars;
-    char *render;
+    long long cap; // chars 缓冲区的容量, 映射区中的行为 0
+    long long gap; // 间隙的起始位置, 等于 size 时 chars 是连续的
+    int rslot; // 在渲染缓存中的位置, -1 表示没有
+    int flags;
+    unsigned gen; // chars 分配时的代数, 用来判断后台保存的快照是否引用着它
+    unsigned char hlstate; // 行末的词法状态, 见 enum hlState
+    struct rowblock *blk; // 行所在的行树节点
 } erow;
 
+// 一种语言的高亮规则, 关键字以 '|' 结尾的是类型名
+typedef struct syntaxdef
+{
+    const char *filetype;
+    const char **filematch; // 以 '.' 开头的按扩展名匹配, 否则匹配文件名的一部分
+    const char **keywords;
+    const char *singleline_comment_start;
+    const char *multiline_comment_start; // NULL 表示没有跨行的状态
+    const char *multiline_comment_end;
+    int flags;
+} syntaxdef;
+
+// 行存储占用的内存
+typedef struct rowmemstats
+{
+    size_t live;     // 正在使用的字节数
+    size_t reserved; // 从系统申请的字节数, 减去 live 即浪费的部分
+    size_t peak;     // reserved 的峰值
+} rowmemstats;
+
+// 行结构和行内容的分配器, 启动时选择
+typedef struct rowallocator
+{
+    const char *name;
+    void *(*alloc)(size_t n);
+    void (*release)(void *p, size_t n); // n 必须与分配时相同
+    size_t (*usable)(size_t n);         // 申请 n 字节时实际可用的大小
+    char *(*text)(size_t n);            // 载入文件时的文本, 不单独释放; NULL 表示按普通行分配
+} rowallocator;
+
+// 渲染缓存的一项, 保存一行展开制表符后的内容
+typedef struct rcacheslot
+{
+    erow *row;
+    char *render;
+    long long cap;
+    int ref; // 最近被使用过, 淘汰时跳过一次
+} rcacheslot;
+
+// 行树的节点: 一块连续的行, 按行号组织成一棵 treap, 子树记录总行数和总字节数
+typedef struct rowblock
+{
+    struct rowblock *left, *right, *parent;
+    unsigned prio;
+    int nrows;       // 本块的行数
+    long long count; // 子树中的总行数
+    long long bytes; // 本块的字节数, 每行算上换行符
+    long long sum;   // 子树中的总字节数
+    erow *rows[ROPE_BLOCK_ROWS];
+} rowblock;
+
+// 一个长行的列映射检查点: rx[i] 是 cx = i * QEDITOR_COL_STEP 处的 rx, 前 n 个有效
+typedef struct colcache
+{
+    erow *row;
+    long long n;
+    long long cap;
+    long long *rx;
+} colcache;
+
+// 按顺序遍历行
+typedef struct rowiter
+{
+    rowblock *blk;
+    int idx;
+} rowiter;
+
+// 查找结果中的一个匹配
+typedef struct searchmatch
+{
+    long long row;
+    long long col;
+} searchmatch;
+
+// 后台查找任务中的一块行, 由某个工作线程独立完成
+typedef struct searchchunk
+{
+    searchmatch *matches;
+    long long nmatches;
+    long long cap;
+    long long from, to; // 块中的行 [from, to)
+    int done; // 原子访问, 为 1 后 matches 不再改变
+} searchchunk;
+
+// 一次后台查找任务, 所有行按 QEDITOR_SEARCH_CHUNK 分块交给工作线程, 载入新的行后追加新的块
+typedef struct searchjob
+{
+    char *query;
+    int qlen;
+    long long numrows; // 已经分块的行数
+    int nchunks;
+    int nextchunk; // 下一个待领取的块, 原子访问
+    int cancel;    // 原子访问
+    int news;      // 有新完成的块, 原子访问
+    searchchunk *chunks;
+} searchjob;
+
+// 后台查找的工作线程池
+typedef struct searchpool
+{
+    pthread_t threads[QEDITOR_SEARCH_THREADS];
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;     // 有新任务
+    pthread_cond_t idle;     // 工作线程都离开了任务
+    pthread_cond_t progress; // 有块完成
+    searchjob *job;
+    int busy; // 正在处理任务的线程数
+} searchpool;
+
+// 一次后台保存: 保存开始时整个缓冲区的快照, 由保存线程写入文件
+typedef struct savejob
+{
+    pthread_t thread;
+    char *filename;
+    struct iovec *pieces; // 快照的内容, 指向各行的缓冲区或映射区
+    int npieces;
+    int cap;
+    long long total;   // 快照的总字节数
+    long long written; // 已写出的字节数, 原子访问
+    int done;          // 原子访问, 为 1 后 err 有效
+    int err;           // 失败时的 errno, 成功为 0
+    int dirty;         // 快照时的 E.dirty
+    unsigned gen;      // 快照时的代数, 不大于它的行缓冲区被快照引用
+    struct iovec *garbage; // 快照引用期间被替换或删除的行缓冲区, 保存结束后释放
+    int ngarbage;
+    int garbagecap;
+    int percent; // 上次显示的进度
+    struct timespec start;
+} savejob;
+
+// 载入线程交给主线程的一批行: 每行在 base 中的位置和去掉换行符后的长度
+typedef struct loadchunk
+{
+    struct loadchunk *next;
+    char *base;   // 映射区, 或者这一批独占的读取缓冲区
+    int owned;    // base 是读取缓冲区, 建立行时复制出来, 之后释放
+    size_t *off;
+    long long *len;
+    int nlines;
+    int cap;
+    size_t bytes; // 这一批在文件中占的字节数, 包括换行符
+} loadchunk;
+
+// 一次后台载入: 载入线程扫描文件, 把切分好的行按批放进队列, 主线程取出后插入行树
+typedef struct loadjob
+{
+    pthread_t thread;
+    int fd;         // 不能映射时读取的文件, 映射时为 -1
+    char *map;
+    size_t size;    // 文件大小, 不是普通文件时为 0
+    size_t loaded;  // 已经插入行树的字节数
+    pthread_mutex_t lock;
+    pthread_cond_t ready; // 队列中有新的一批, 或者载入结束
+    loadchunk *head, *tail;
+    int done; // 载入线程已结束, 队列不会再增加
+    int err;  // 读取失败时的 errno
+    long long last; // 上次记录载入耗时的时刻
+} loadjob;
+
+// 只读查看模式 (--view) 和跟随文件增长 (--follow) 的状态
+typedef struct viewstate
+{
+    int on;      // 只读: 行直接指向映射区或读取缓冲区, 不修改也不保存
+    int follow;  // 文件增长时把新的内容追加成行
+    int fd;      // 正在跟随的文件, -1 表示没有跟随
+    long long off;  // 已经成为行的内容的末尾
+    long long part; // 最后一行没有换行符时是它的开头, 之后追加时重新读这一行; 否则等于 off
+    char *partbuf;  // 只含不完整的最后一行的缓冲区, 这一行被替换时释放
+} viewstate;
+
+// 重新载入时的一处变化: 从第 at 行开始的 del 行换成新内容中从第 from 行开始的 ins 行
+typedef struct reloadop
+{
+    long long at, del;
+    long long from, ins;
+} reloadop;
+
+// 重新载入时按块读取新的内容: buf 中是文件的 [lo, hi)
+typedef struct reloadreader
+{
+    int fd;
+    char *buf;
+    long long cap;
+    long long lo, hi;
+    long long size; // 要读的内容的末尾
+} reloadreader;
+
+// 撤销日志中的一条记录, 文本保存在日志的 arena 中
+typedef struct undorec
+{
+    int type;
+    int run;        // 单个字符的插入或删除, 可以与下一次按键合并
+    unsigned group; // 产生这条记录的按键, 同一次按键的记录一起撤销
+    long long row, col;
+    long long len;
+    size_t off;         // 文本在 arena 中的逻辑偏移
+    long long bcx, bcy; // 按键之前的光标位置
+    long long acx, acy; // 按键之后的光标位置
+} undorec;
+
+// 撤销日志: 只记录操作和改动的文本, 占用内存超过上限时淘汰最早的记录
+typedef struct undolog
+{
+    undorec *recs;
+    int first; // 最早的有效记录, 之前的已被淘汰
+    int pos;   // 下一条撤销的是 pos-1, [pos, nrecs) 可以重做
+    int nrecs;
+    int cap;
+    char *arena;
+    size_t abase; // arena[0] 的逻辑偏移
+    size_t aend;  // 已使用部分末尾的逻辑偏移
+    size_t acap;
+    size_t limit;   // 占用内存的上限
+    unsigned group; // 当前按键的编号
+    long long cx, cy; // 当前按键开始时的光标位置
+    int suspend;    // 大于 0 时不记录, 用于载入文件和撤销重做本身
+} undolog;
+
+// 无终端回放的统计, 每个按键一项
+typedef struct benchstats
+{
+    long long *latency; // 从读入按键到一帧输出完成的纳秒数
+    int *bytes;         // 这一帧输出的字节数
+    long *allocs;       // 处理这个按键时的内存分配次数
+    int n;
+    int cap;
+} benchstats;
+
+// 性能计数, Ctrl-P 显示在屏幕上, --stats-file 在退出时写成 JSON
+typedef struct profstats
+{
+    long long frames;
+    long long scrollns, drawns, writens; // 上一帧各阶段的纳秒数
+    long long scrolltotal, drawtotal, writetotal;
+    int framebytes;        // 上一帧输出的字节数
+    long long bytestotal;
+    int framereallocs;     // 上一帧 abAppend 扩容的次数
+    long long reallocs;
+    long long loadbytes, loadns; // 载入和建立行索引
+    long long savebytes, savens; // 后台保存, 从快照到写完
+} profstats;
+
+// 终端上已经显示的一行内容, 缓冲区在各帧之间重复使用
+typedef struct frameline
+{
+    char *b;
+    int len;
+    int cap;
+    int attr; // 1 表示反色显示
+} frameline;
+
+// 可以增长的缓冲区, 清空时保留内存
+struct abuf
+{
+    char *b;
+    int len;
+    int cap;
+};
+
+// 一帧输出中的一段: base 为 NULL 时是 E.out 中从 off 开始的内容, 否则直接指向 base
+typedef struct outpiece
+{
+    const char *base;
+    int off;
+    int len;
+} outpiece;
+
 // 编辑器配置
 struct editorConfig
 {
-    int cx, cy;     // 光标当前所在的列, 行
-    int rx;         // 光标在渲染后的行中的横向位置
-    int rowoff;     // 行偏移量
-    int coloff;     // 列偏移量
-    int screenrows; // 行数
-    int screencols; // 列数
-    int numrows;    // 整个文件行数
-    erow *row;      // 存储每一行的文本信息与渲染信息
+    long long cx, cy;  // 光标当前所在的列, 行
+    long long rx;      // 光标在渲染后的行中的横向位置
+    long long rowoff;  // 行偏移量
+    long long coloff;  // 列偏移量
+    int screenrows;    // 行数
+    int screencols;    // 列数
+    long long numrows; // 整个文件行数
+    rowblock *rope; // 存储每一行的文本信息与渲染信息的行树
+    erow *gaprow;   // 当前间隙不在行尾的行, 同一时刻最多一行
+    rcacheslot *rcache; // 渲染缓存
+    int rcachelen;
+    int rchand; // 时钟淘汰算法的指针
+    colcache colcache[QEDITOR_COL_ROWS]; // 最近用到的长行的列映射检查点
+    int colhand;                         // 下一个被替换的检查点
+    frameline *frame; // 终端上当前显示的内容, 包括状态栏和消息栏
+    struct abuf line; // 正在绘制的一行, 与 frame 中的缓冲区交换使用
+    struct abuf out;  // 一帧输出中的转义序列
+    outpiece *pieces; // 一帧输出的各段, 按顺序用一次 writev 写出
+    int npieces;
+    int piececap;
+    struct iovec *iov;
+    int framevalid;   // 为 0 时下一帧完整重绘
+    long long framerowoff; // 上一帧的行偏移量
+    long long framecoloff; // 上一帧的列偏移量
+    // 子串查找函数, 启动时根据 CPU 支持的指令集选择
+    const char *(*memsearch)(const char *hay, size_t n, const char *needle, size_t m);
+    searchpool search;
+    char promptinfo[64]; // 显示在提示信息后面的附加信息
+    savejob *save;       // 正在进行的后台保存
+    undolog undo;
+    const rowallocator *rowalloc;
+    rowmemstats rowmem;
+    void *slabfree[ROW_SLAB_CLASSES]; // 每个级别的空闲链表
+    char *slabpage;                   // 正在切分的页
+    size_t slableft;
+    char *arena; // 正在使用的文本 arena
+    size_t arenaleft;
+    unsigned gen;        // 新分配的行缓冲区的代数, 每次保存快照后加一
     int dirty;
     char *filename;
+    const syntaxdef *syntax; // 当前文件的高亮规则, NULL 表示不高亮
+    long long hlfrom;  // 之前各行的行末状态都是正确的
+    long long hlstale; // [hlfrom, hlstale) 中的行在上次计算状态后被修改过
+    long long hlvalid; // 计算过行末状态的行数, 之后的行都是 HLS_UNKNOWN
+    unsigned char *hl; // 绘制一行时的高亮结果
+    long long hlcap;
+    char *map;      // mmap 映射的文件内容
+    size_t mapsize; // 映射区大小
+    dev_t mapdev;   // 映射的文件, 它在原处被修改时映射区的内容跟着变
+    ino_t mapino;
+    loadjob *load;  // 正在进行的后台载入, NULL 表示全部的行都已载入
+    viewstate view;
+    int watching;     // 监视打开的文件: 跟随时读入新的内容, 否则在其他程序修改后重新载入
+    int watchfd;      // inotify 实例, 监视文件本身和所在目录; -1 时改为定期检查
+    int watchwd;      // 对文件本身的监视, 文件被替换后重新建立
+    int watchpending; // 文件可能有变化, 还没有处理
+    struct stat disk; // 上次载入、保存或重新载入时磁盘上的文件
+    int wakefd[2]; // 后台线程和信号处理函数写入这个管道唤醒主循环
+    int infd;      // 读取按键的文件, 回放时是按键脚本
+    int recordfd;  // 记录输入的按键脚本, -1 表示不记录
+    int headless;  // 无终端回放模式, 输出只统计不写出
+    long long outbytes; // 回放时累计输出的字节数
+    benchstats bench;
+    profstats prof;
+    int profoverlay;  // 在屏幕底部显示性能信息
+    char *statsfile;  // 退出时写入性能计数的文件
+    volatile sig_atomic_t winch; // 收到了 SIGWINCH, 窗口大小需要更新
+    long long timers[QEDITOR_TIMERS]; // 各定时器的到期时间 (毫秒), 0 表示未设置
+    char inbuf[4096]; // 已读入但还没有解码的输入
+    int inpos;
+    int inlen;
+    char *paste; // 最近一次粘贴的文本
+    size_t pastelen;
+    size_t pastecap;
+    int pasting; // 粘贴的内容超过 QEDITOR_PASTE_MAX, 还没有读到结束标记
     char statusmsg[80];          // 状态栏的状态消息文本
     time_t statusmsg_time;       // 状态消息的显示时间戳
     struct termios orig_termios; // 原始的终端属性
 };
 struct editorConfig E;
 
+/******************** filetypes ********************/
+const char *C_HL_extensions[] = {".c", ".h", ".cpp", ".cc", ".hpp", NULL};
+const char *C_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "class", "case", "default",
+    "goto", "do", "sizeof", "const", "volatile", "extern", "inline",
+    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+    "void|", "short|", "size_t|", NULL};
+
+const char *PY_HL_extensions[] = {".py", NULL};
+const char *PY_HL_keywords[] = {
+    "def", "class", "return", "if", "elif", "else", "for", "while", "in",
+    "not", "and", "or", "is", "import", "from", "as", "with", "try", "except",
+    "finally", "raise", "pass", "break", "continue", "lambda", "yield", "global",
+    "None|", "True|", "False|", "self|", NULL};
+
+const char *SH_HL_extensions[] = {".sh", "Makefile", NULL};
+const char *SH_HL_keywords[] = {
+    "if", "then", "else", "elif", "fi", "for", "while", "do", "done", "case",
+    "esac", "in", "function", "return", "export", "local", NULL};
+
+// 高亮规则表, 新增语言只需要在这里加一项
+const syntaxdef HLDB[] = {
+    {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+    {"python", PY_HL_extensions, PY_HL_keywords, "#", NULL, NULL,
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+    {"sh", SH_HL_extensions, SH_HL_keywords, "#", NULL, NULL,
+     HL_HIGHLIGHT_STRINGS},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
 
 /******************** prototypes ********************/
 void editorSetStatusMessage(const char* fmt, ...);
 void editorRefreshScreen();
 char* editorPrompt(char* prompt, void(*callback)(char*, int));
+void editorLoadRows(long long upto);
+void editorLoadAll();
+int editorPollTasks();
+int editorWatchPoll();
+void editorWatchStart();
+void editorFollowLoaded(long long loaded);
+int searchIdle();
+void searchWaitIdle();
+void searchExtend();
+void searchCancel();
+void saveDefer(savejob *job, char *chars, long long cap);
+void editorUndoRecord(int type, long long row, long long col, const char *s, long long len, int run);
+int editorHandleResize();
+void editorFrameAlloc();
+void editorSyntaxUpdateRow(erow *row);
+void editorSyntaxInsertRow(long long at);
+void editorSyntaxDelRow(long long at);
 
 
 
@@ -92,6 +570,7 @@ void die(const char *s)
 // 恢复终端的原始模式
 void disableRawMode()
 {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8); // 关闭括号粘贴模式
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
         die("tcsetattr");
 }
@@ -109,31 +588,191 @@ void enableRawMode()
     raw.c_oflag &= ~(OPOST);
     raw.c_cflag |= ~(CS8);
     raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    // read 不等待, 没有输入时由 poll 阻塞
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
         die("tcsetattr");
+    // 开启括号粘贴模式, 粘贴的内容夹在 \x1b[200~ 和 \x1b[201~ 之间
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+// 唤醒阻塞在 editorWaitEvent 中的主循环, 可以在其他线程和信号处理函数中调用
+void editorWake()
+{
+    int saved = errno;
+    write(E.wakefd[1], "", 1); // 管道已满时主循环一定会被唤醒, 不必处理失败
+    errno = saved;
+}
+
+void editorSigwinch(int sig)
+{
+    (void)sig;
+    E.winch = 1;
+    editorWake();
+}
+
+long long editorNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+long long editorNowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void editorSetTimer(int id, int ms)
+{
+    E.timers[id] = editorNow() + ms;
+}
+
+// 清除到期的定时器, 有定时器到期时返回 1
+int editorRunTimers()
+{
+    long long now = editorNow();
+    int fired = 0;
+    int i;
+    for (i = 0; i < QEDITOR_TIMERS; i++)
+    {
+        if (E.timers[i] && E.timers[i] <= now)
+        {
+            E.timers[i] = 0;
+            fired = 1;
+        }
+    }
+    return fired;
+}
+
+// 距最近的定时器到期的毫秒数, 没有定时器时返回 -1
+int editorTimerTimeout()
+{
+    long long now = editorNow();
+    long long next = -1;
+    int i;
+    for (i = 0; i < QEDITOR_TIMERS; i++)
+    {
+        if (E.timers[i] && (next == -1 || E.timers[i] - now < next))
+            next = E.timers[i] > now ? E.timers[i] - now : 0;
+    }
+    return (int)next;
+}
+
+// 阻塞直到有输入、后台线程唤醒、跟随的文件变化、收到信号或最近的定时器到期
+void editorWaitEvent()
+{
+    // 没有监视文件时 watchfd 为 -1, poll 会忽略它; 文件的变化在 editorPollTasks 中处理
+    struct pollfd pfd[3] = {{E.infd, POLLIN, 0}, {E.wakefd[0], POLLIN, 0}, {E.watchfd, POLLIN, 0}};
+    if (poll(pfd, 3, editorTimerTimeout()) > 0 && (pfd[1].revents & POLLIN))
+    {
+        char buf[64];
+        while (read(E.wakefd[0], buf, sizeof(buf)) > 0)
+            ;
+    }
+}
+
+// 从输入缓冲区取一个字节, 缓冲区空时一次读入所有可用的输入;
+// 最多等待 timeout 毫秒, 仍然没有输入时返回 0
+int editorInputByte(char *c, int timeout)
+{
+    if (E.inpos == E.inlen)
+    {
+        struct pollfd pfd = {E.infd, POLLIN, 0};
+        if (timeout && poll(&pfd, 1, timeout) <= 0)
+            return 0;
+        ssize_t n = read(E.infd, E.inbuf, sizeof(E.inbuf));
+        if (n == -1 && errno != EAGAIN && errno != EINTR)
+            die("read");
+        if (n == 0 && E.headless)
+            exit(0); // 按键脚本回放完了, 统计结果在 atexit 中输出
+        if (n <= 0)
+            return 0;
+        if (E.recordfd != -1)
+            write(E.recordfd, E.inbuf, n);
+        E.inpos = 0;
+        E.inlen = n;
+    }
+    *c = E.inbuf[E.inpos++];
+    return 1;
+}
+
+// 是否还有没处理的输入, 有的话先处理完再刷新屏幕
+int editorInputPending()
+{
+    if (E.inpos < E.inlen)
+        return 1;
+    struct pollfd pfd = {E.infd, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// 读取括号粘贴的内容, 直到结束标记 \x1b[201~。读满 QEDITOR_PASTE_MAX 字节时先交出这一段,
+// 下次读键时接着读 (E.pasting); 超过 QEDITOR_PASTE_WAIT 毫秒没有输入时认为结束标记丢了,
+// 交出已读到的内容并回到普通输入
+void editorReadPaste()
+{
+    const char *end = "\x1b[201~";
+    E.pastelen = 0;
+    E.pasting = 0;
+    char c;
+    int idle = 0;
+    while (E.pastelen < 6 || memcmp(&E.paste[E.pastelen - 6], end, 6) != 0)
+    {
+        if (!editorInputByte(&c, 100))
+        {
+            idle += 100;
+            if (idle >= QEDITOR_PASTE_WAIT)
+                return;
+            continue;
+        }
+        idle = 0;
+        if (E.pastelen == E.pastecap)
+        {
+            E.pastecap = E.pastecap ? E.pastecap * 2 : 4096;
+            E.paste = realloc(E.paste, E.pastecap);
+        }
+        E.paste[E.pastelen++] = c;
+        // 留下最后 5 个字节, 它们可能是被分开的结束标记的开头
+        if (E.pastelen >= QEDITOR_PASTE_MAX && memchr(&E.paste[E.pastelen - 5], '\x1b', 5) == NULL)
+        {
+            E.pasting = 1;
+            return;
+        }
+    }
+    E.pastelen -= 6;
 }
 
 // 读取用户按键输入
 int editorReadKey()
 {
-    int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+    if (E.pasting)
     {
-        // EAGAIN（表示暂时无可用数据）
-        if (nread == -1 && errno != EAGAIN)
-            die("read");
+        editorReadPaste();
+        return PASTE_TEXT;
+    }
+    // 文件的变化先于新的按键处理, 否则按键可能让屏幕显示映射区中已被截掉的行
+    if (E.inpos == E.inlen && editorWatchPoll())
+        return BG_EVENT;
+    while (!editorInputByte(&c, 0))
+    {
+        // 没有输入时处理后台任务、定时器和窗口大小变化, 需要刷新屏幕时返回 BG_EVENT
+        if (editorPollTasks() || editorRunTimers() || editorHandleResize())
+            return BG_EVENT;
+        editorWaitEvent();
     }
     // 控制码的处理
     if (c == '\x1b')
     {
         char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1)
+        // 转义序列的后续字节最多等待 100 毫秒, 等不到时当作单独的 ESC 键
+        if (!editorInputByte(&seq[0], 100))
             return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1)
+        if (!editorInputByte(&seq[1], 100))
             return '\x1b';
         // 如果第一个后续字符是 [，则可能是功能键或控制序列。
         if (seq[0] == '[')
@@ -141,7 +780,22 @@ int editorReadKey()
             // 如果第二个后续字符是数字字符，表示功能键，需要继续读取一个后续字符
             if (seq[1] >= '0' && seq[1] <= '9')
             {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
+                // 数字可能有多位, 例如粘贴的开始标记 \x1b[200~
+                int num = seq[1] - '0';
+                while (1)
+                {
+                    if (!editorInputByte(&seq[2], 100))
+                        return '\x1b';
+                    if (seq[2] < '0' || seq[2] > '9')
+                        break;
+                    num = num * 10 + seq[2] - '0';
+                }
+                if (seq[2] == '~' && num == 200)
+                {
+                    editorReadPaste();
+                    return PASTE_TEXT;
+                }
+                if (num > 9)
                     return '\x1b';
                 /*如果第三个后续字符是波浪符 ~，则根据第二个后续字符确定具体的功能键，
                 并返回相应的键盘码（例如 HOME_KEY、DEL_KEY 等）*/
@@ -205,7 +859,7 @@ int editorReadKey()
     }
     else
     {
-        return c;
+        return (unsigned char)c;
     }
 }
 
@@ -220,7 +874,7 @@ int getCursorPosition(int *rows, int *cols)
 
     while (i < sizeof(buf) - 1)
     {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1)
+        if (!editorInputByte(&buf[i], 100))
             break;
         if (buf[i] == 'R')
             break;
@@ -275,305 +929,3651 @@ int getWindowSize2(int *rows, int *cols)
     }
 }
 
-/******************** row operations ********************/
-
-// 将制表符（\t）转换为相应的空格数量
-int editorRowCxToRx(erow *row, int cx)
+// 收到 SIGWINCH 后重新获取窗口大小, 下一帧完整重绘; 大小变化时返回 1
+int editorHandleResize()
 {
-    int rx = 0;
+    if (!E.winch)
+        return 0;
+    E.winch = 0;
+    int rows, cols;
+    if (getWindowSize2(&rows, &cols) == -1)
+        return 0;
+
     int j;
-    for (j = 0; j < cx; j++)
+    for (j = 0; j < E.screenrows + 2; j++)
+        free(E.frame[j].b);
+    free(E.frame);
+    E.screenrows = rows > 3 ? rows - 2 : 1;
+    E.screencols = cols;
+    editorFrameAlloc();
+    E.framevalid = 0;
+
+    // 渲染缓存至少容纳两屏
+    if (E.screenrows * 2 > E.rcachelen)
     {
-        if (row->chars[j] == '\t')
-        {
-            // 根据余数计算出当前渲染坐标距离下一个制表符位置还需添加的空格数
-            rx += (QEDITOR_TAB_STOP - 1) - (rx % QEDITOR_TAB_STOP);
-        }
-        rx++;
+        E.rcache = realloc(E.rcache, sizeof(rcacheslot) * E.screenrows * 2);
+        memset(&E.rcache[E.rcachelen], 0, sizeof(rcacheslot) * (E.screenrows * 2 - E.rcachelen));
+        E.rcachelen = E.screenrows * 2;
     }
-    return rx;
+    return 1;
 }
 
-int editorRowRxToCx(erow* row, int rx){
-    int cur_rx = 0;
-    int cx;
-    for(cx = 0; cx<row->size; cx++){
-        if(row->chars[cx] == '\t')
-            cur_rx += (QEDITOR_TAB_STOP-1) - (cur_rx % QEDITOR_TAB_STOP);
-        
-        cur_rx++;
+/******************** row memory ********************/
+/*
+行结构和行内容从这里分配。不超过 512 字节的小块按大小分级, 从 64KB 的页中切出,
+释放后挂在对应级别的空闲链表上复用; 载入文件时的文本连续地存放在 arena 中, 直到程序
+结束都不释放。设置环境变量 QEDITOR_ROW_ALLOC=malloc 时每块单独 malloc, 用来比较内存占用。
+*/
 
-        if(cur_rx > rx) return cx;
-    }
+const size_t slabClasses[ROW_SLAB_CLASSES] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512};
 
-    return cx;
+void rowMemGrow(size_t n)
+{
+    E.rowmem.reserved += n;
+    if (E.rowmem.reserved > E.rowmem.peak)
+        E.rowmem.peak = E.rowmem.reserved;
 }
 
-void editorUpdateRow(erow *row)
+int slabClass(size_t n)
 {
-    int tabs = 0; // 制表符数量
-    int j;
-    for (j = 0; j < row->size; j++)
+    int c;
+    for (c = 0; c < ROW_SLAB_CLASSES; c++)
+        if (n <= slabClasses[c])
+            return c;
+    return -1;
+}
+
+void *slabAlloc(size_t n)
+{
+    int c = slabClass(n);
+    if (c == -1)
     {
-        if (row->chars[j] == '\t')
-            tabs++;
+        E.rowmem.live += n;
+        rowMemGrow(n);
+        return malloc(n);
     }
-    free(row->render);
-    // 原始文本字符数加上需要插入的空格数量, +1 是为了预留 '\0'结尾
-    row->render = malloc(row->size + tabs * (QEDITOR_TAB_STOP - 1) + 1);
-
-    int idx = 0; // 记录渲染数据数组的索引
-    for (j = 0; j < row->size; j++)
+    E.rowmem.live += slabClasses[c];
+    void *p = E.slabfree[c];
+    if (p)
     {
-        if (row->chars[j] == '\t')
-        {
-            row->render[idx++] = ' ';
-            while (idx % QEDITOR_TAB_STOP != 0)
-                row->render[idx++] = ' ';
-        }
-        else
-        {
-            row->render[idx++] = row->chars[j];
-        }
+        E.slabfree[c] = *(void **)p;
+        return p;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    if (E.slableft < slabClasses[c])
+    {
+        // 旧页剩下的尾部不再使用
+        E.slabpage = malloc(ROW_SLAB_PAGE);
+        E.slableft = ROW_SLAB_PAGE;
+        rowMemGrow(ROW_SLAB_PAGE);
+    }
+    p = E.slabpage;
+    E.slabpage += slabClasses[c];
+    E.slableft -= slabClasses[c];
+    return p;
 }
 
-void editorInsertRow(int at, char *s, size_t len)
+void slabRelease(void *p, size_t n)
 {
-    if(at<0 || at>E.numrows) return;
-
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
-
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    editorUpdateRow(&E.row[at]);
+    int c = slabClass(n);
+    if (c == -1)
+    {
+        E.rowmem.live -= n;
+        E.rowmem.reserved -= n;
+        free(p);
+        return;
+    }
+    E.rowmem.live -= slabClasses[c];
+    *(void **)p = E.slabfree[c];
+    E.slabfree[c] = p;
+}
 
-    E.numrows++;
-    E.dirty++;
+size_t slabUsable(size_t n)
+{
+    int c = slabClass(n);
+    return c == -1 ? n : slabClasses[c];
 }
 
-void editorFreeRow(erow* row){
-    free(row->render);
-    free(row->chars);
+char *arenaText(size_t n)
+{
+    E.rowmem.live += n;
+    if (n > ROW_ARENA_CHUNK / 4)
+    {
+        rowMemGrow(n);
+        return malloc(n);
+    }
+    if (E.arenaleft < n)
+    {
+        E.arena = malloc(ROW_ARENA_CHUNK);
+        E.arenaleft = ROW_ARENA_CHUNK;
+        rowMemGrow(ROW_ARENA_CHUNK);
+    }
+    char *p = E.arena;
+    E.arena += n;
+    E.arenaleft -= n;
+    return p;
 }
 
-void editorDelRow(int at){
-    if(at<0 || at>=E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at+1], sizeof(erow) * (E.numrows-at-1));
-    E.numrows--;
-    E.dirty++;
+// malloc 的实际占用: 8 字节头部, 按 16 字节对齐, 最小 32 字节
+size_t mallocChunk(size_t n)
+{
+    size_t chunk = (n + 8 + 15) & ~(size_t)15;
+    return chunk < 32 ? 32 : chunk;
 }
 
-void editorRowInsertChar(erow *row, int at, int c)
+void *mallocAlloc(size_t n)
 {
-    if (at < 0 || at > row->size)
-        at = row->size;
-    // 调整文本行的字符数组的大小
-    row->chars = realloc(row->chars, row->size + 2);
-    // 将插入位置之后的字符向后移动一位，为新字符 c 腾出位置
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+    E.rowmem.live += n;
+    rowMemGrow(mallocChunk(n));
+    return malloc(n);
 }
 
-void EditorRowApendString(erow* row, char* s, size_t len){
-    row->chars = realloc(row->chars, row->size+len+1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+void mallocRelease(void *p, size_t n)
+{
+    E.rowmem.live -= n;
+    E.rowmem.reserved -= mallocChunk(n);
+    free(p);
 }
 
-void editorRowDelChar(erow* row, int at){
-    if(at<0 || at>= row->size) return;
-    memmove(&row->chars[at], &row->chars[at+1], row->size-at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+size_t mallocUsable(size_t n)
+{
+    return n;
 }
 
+const rowallocator slabAllocator = {"slab", slabAlloc, slabRelease, slabUsable, arenaText};
+const rowallocator mallocAllocator = {"malloc", mallocAlloc, mallocRelease, mallocUsable, NULL};
 
-/******************** editor operations ********************/
-void editorInsertChar(int c)
+void *rowAlloc(size_t n)
 {
-    if (E.cy == E.numrows)
-    {
-        editorInsertRow(E.numrows, "", 0);
-    }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    return E.rowalloc->alloc(n);
 }
 
-void editorInsertNewline(){
-    if(E.cx == 0){
-        //所在行之前插入一个新空行
-        editorInsertRow(E.cy, "", 0);
-    }else{
-        erow* row = &E.row[E.cy];
-        editorInsertRow(E.cy+1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
-    }
-    E.cy++;
-    E.cx = 0;
+void rowFree(void *p, size_t n)
+{
+    E.rowalloc->release(p, n);
 }
 
-void editorDelChar(){
-    if(E.cy == E.numrows) return;
-    if(E.cx == 0 && E.cy == 0) return;
-
-    erow* row = &E.row[E.cy];
-    if(E.cx >0){
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
-    }else{
-        E.cx = E.row[E.cy-1].size;
-        EditorRowApendString(&E.row[E.cy-1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
-    }
+// 载入时的文本所在的行不再使用它, 空间留在 arena 中算作浪费
+void rowTextDrop(size_t n)
+{
+    E.rowmem.live -= n;
 }
 
-/******************** file i/o ********************/
-//缓冲区 erow 的数组转换单独字符串
-char* editorRowsToString(int* buflen){
-    int totlen = 0;
-    int j;
-    for(j=0; j<E.numrows; j++){
-        totlen += E.row[j].size+1;
-    }
-    *buflen = totlen;
-
-    char* buf = malloc(totlen);
-    char* p = buf;
-    for(j = 0; j<E.numrows; j++){
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p+=E.row[j].size;
-        *p='\n';
-        p++;
-    }
-    return buf;
+void editorInitRowAlloc()
+{
+    char *name = getenv("QEDITOR_ROW_ALLOC");
+    E.rowalloc = name && strcmp(name, "malloc") == 0 ? &mallocAllocator : &slabAllocator;
 }
 
-
-
-// 打开文件并将其内容读取到编辑器的行数组中
-void editorOpen(char *filename)
+void editorShowRowMem()
 {
-    free(E.filename);
-    E.filename = strdup(filename);
+    editorSetStatusMessage("rows (%s): %.1f MB live, %.1f MB wasted, %.1f MB peak",
+                           E.rowalloc->name, E.rowmem.live / 1048576.0,
+                           (E.rowmem.reserved - E.rowmem.live) / 1048576.0, E.rowmem.peak / 1048576.0);
+}
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
-        die("fopen");
+/******************** utf-8 ********************/
+/*
+行中保存的是 UTF-8 字节。显示宽度查 unicode_width.h 中生成的区间表, ASCII 字符不查表;
+光标按字素簇移动: 一个字符连同后面的组合字符、变体选择符、肤色修饰符, 以及用零宽连接符
+连起来的字符, 作为一个整体。
+*/
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1)
+// 解码 s 开头的一个字符, 返回占用的字节数; 无效的序列按一个字节处理, *cp 为 -1
+int utf8Decode(const char *s, long long len, int *cp)
+{
+    unsigned char c = s[0];
+    int n = c < 0x80 ? 1 : c >= 0xf0 && c < 0xf8 ? 4 : c >= 0xe0 ? 3 : c >= 0xc2 ? 2 : 0;
+    if (n == 1 || n == 0 || n > len)
     {
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+        *cp = n == 1 ? c : -1;
+        return 1;
+    }
+    int v = c & (0x7f >> n);
+    int i;
+    for (i = 1; i < n; i++)
+    {
+        if (((unsigned char)s[i] & 0xc0) != 0x80)
         {
-            linelen--;
+            *cp = -1;
+            return 1;
         }
-        editorInsertRow(E.numrows, line, linelen);
+        v = (v << 6) | (s[i] & 0x3f);
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    *cp = v;
+    return n;
 }
 
-void editorSave(){
-    if(E.filename == NULL) {
+int widthLookup(const unsigned int (*table)[2], int n, int cp)
+{
+    int lo = 0, hi = n - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if ((unsigned int)cp < table[mid][0])
+            hi = mid - 1;
+        else if ((unsigned int)cp > table[mid][1])
+            lo = mid + 1;
+        else
+            return 1;
+    }
+    return 0;
+}
+
+// 字符的显示宽度: 0、1 或 2; 无效字节按 1 列显示
+int charWidth(int cp)
+{
+    if (cp < 0x80)
+        return 1;
+    if (widthLookup(widthZero, sizeof(widthZero) / sizeof(widthZero[0]), cp))
+        return 0;
+    if (widthLookup(widthWide, sizeof(widthWide) / sizeof(widthWide[0]), cp))
+        return 2;
+    return 1;
+}
+
+// 字符是否附着在前一个字符上, 与它组成同一个字素簇
+int charExtends(int cp)
+{
+    return cp >= 0x300 && (charWidth(cp) == 0 || (cp >= 0x1f3fb && cp <= 0x1f3ff));
+}
+
+int charRegional(int cp)
+{
+    return cp >= 0x1f1e6 && cp <= 0x1f1ff;
+}
+
+// 是否包含 ASCII 以外的字节, 每次检查 8 个字节
+int utf8HasHigh(const char *s, size_t len)
+{
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        unsigned long long w;
+        memcpy(&w, &s[i], 8);
+        if (w & 0x8080808080808080ULL)
+            return 1;
+    }
+    for (; i < len; i++)
+        if (s[i] & 0x80)
+            return 1;
+    return 0;
+}
+
+/******************** row storage ********************/
+/*
+所有行保存在一棵以块为节点的 treap 中, 按行号查找、插入和删除都是 O(log n),
+行结构本身单独分配, 指针在插入删除其他行时保持不变。
+*/
+
+long long ropeCount(rowblock *b)
+{
+    return b ? b->count : 0;
+}
+
+long long ropeSum(rowblock *b)
+{
+    return b ? b->sum : 0;
+}
+
+// 重新计算子树行数和字节数, 并修正子节点的父指针
+void ropePull(rowblock *b)
+{
+    b->count = b->nrows + ropeCount(b->left) + ropeCount(b->right);
+    b->sum = b->bytes + ropeSum(b->left) + ropeSum(b->right);
+    if (b->left)
+        b->left->parent = b;
+    if (b->right)
+        b->right->parent = b;
+}
+
+rowblock *ropeMerge(rowblock *a, rowblock *b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (a->prio > b->prio)
+    {
+        a->right = ropeMerge(a->right, b);
+        ropePull(a);
+        return a;
+    }
+    b->left = ropeMerge(a, b->left);
+    ropePull(b);
+    return b;
+}
+
+// 按行号 at 拆分, at 必须落在块的边界上
+void ropeSplit(rowblock *t, long long at, rowblock **l, rowblock **r)
+{
+    if (!t)
+    {
+        *l = *r = NULL;
+        return;
+    }
+    long long lc = ropeCount(t->left);
+    if (at <= lc)
+    {
+        ropeSplit(t->left, at, l, &t->left);
+        ropePull(t);
+        *r = t;
+    }
+    else
+    {
+        ropeSplit(t->right, at - lc - t->nrows, &t->right, r);
+        ropePull(t);
+        *l = t;
+    }
+}
+
+// 块的行数和字节数改变后, 更新它自己和祖先的统计
+void ropeFixCounts(rowblock *b, int rows, long long bytes)
+{
+    b->bytes += bytes;
+    for (; b; b = b->parent)
+    {
+        b->count += rows;
+        b->sum += bytes;
+    }
+}
+
+void ropeSetRoot(rowblock *b)
+{
+    E.rope = b;
+    if (b)
+        b->parent = NULL;
+}
+
+// 返回包含第 at 行的块, *idx 为该行在块内的下标
+rowblock *ropeFind(long long at, int *idx)
+{
+    rowblock *b = E.rope;
+    *idx = 0;
+    while (b)
+    {
+        long long lc = ropeCount(b->left);
+        if (at < lc)
+        {
+            b = b->left;
+        }
+        else if (at < lc + b->nrows)
+        {
+            *idx = (int)(at - lc);
+            return b;
+        }
+        else
+        {
+            at -= lc + b->nrows;
+            b = b->right;
+        }
+    }
+    return NULL;
+}
+
+// 块在整个文件中的起始行号
+long long ropeBlockStart(rowblock *b)
+{
+    long long at = ropeCount(b->left);
+    for (; b->parent; b = b->parent)
+    {
+        if (b->parent->right == b)
+            at += ropeCount(b->parent->left) + b->parent->nrows;
+    }
+    return at;
+}
+
+rowblock *ropeNext(rowblock *b)
+{
+    if (b->right)
+    {
+        b = b->right;
+        while (b->left)
+            b = b->left;
+        return b;
+    }
+    while (b->parent && b->parent->right == b)
+        b = b->parent;
+    return b->parent;
+}
+
+rowblock *ropePrev(rowblock *b)
+{
+    if (b->left)
+    {
+        b = b->left;
+        while (b->right)
+            b = b->right;
+        return b;
+    }
+    while (b->parent && b->parent->left == b)
+        b = b->parent;
+    return b->parent;
+}
+
+rowblock *ropeNewBlock()
+{
+    rowblock *b = malloc(sizeof(rowblock));
+    b->left = b->right = b->parent = NULL;
+    b->prio = (unsigned)rand();
+    b->nrows = 0;
+    b->count = 0;
+    b->bytes = 0;
+    b->sum = 0;
+    return b;
+}
+
+// 把块从树中摘除并释放
+void ropeRemoveBlock(rowblock *b)
+{
+    rowblock *p = b->parent;
+    rowblock *m = ropeMerge(b->left, b->right);
+    if (!p)
+    {
+        ropeSetRoot(m);
+    }
+    else
+    {
+        if (p->left == b)
+            p->left = m;
+        else
+            p->right = m;
+        if (m)
+            m->parent = p;
+        for (; p; p = p->parent)
+        {
+            p->count -= b->nrows;
+            p->sum -= b->bytes;
+        }
+    }
+    free(b);
+}
+
+// 在第 at 行之前插入一行
+void ropeInsert(long long at, erow *row)
+{
+    int idx;
+    rowblock *b;
+    if (at == ropeCount(E.rope))
+    {
+        // 追加到最后一个块的末尾
+        b = E.rope;
+        while (b && b->right)
+            b = b->right;
+        idx = b ? b->nrows : 0;
+    }
+    else
+    {
+        b = ropeFind(at, &idx);
+    }
+
+    row->blk = NULL;
+    if (!b)
+    {
+        b = ropeNewBlock();
+        row->blk = b;
+        b->rows[b->nrows++] = row;
+        b->bytes = row->size + 1;
+        ropePull(b);
+        ropeSetRoot(b);
+        return;
+    }
+
+    if (b->nrows == ROPE_BLOCK_ROWS)
+    {
+        // 块已满, 后一半移到新块中, 新块插入到树中紧跟在原块之后
+        rowblock *nb = ropeNewBlock();
+        int half = ROPE_BLOCK_ROWS / 2;
+        nb->nrows = ROPE_BLOCK_ROWS - half;
+        memcpy(nb->rows, &b->rows[half], sizeof(erow *) * nb->nrows);
+        int i;
+        for (i = 0; i < nb->nrows; i++)
+        {
+            nb->rows[i]->blk = nb;
+            nb->bytes += nb->rows[i]->size + 1;
+        }
+        b->nrows = half;
+        ropeFixCounts(b, -nb->nrows, -nb->bytes);
+        ropePull(nb);
+
+        long long end = ropeBlockStart(b) + b->nrows;
+        rowblock *l, *r;
+        ropeSplit(E.rope, end, &l, &r);
+        ropeSetRoot(ropeMerge(ropeMerge(l, nb), r));
+
+        if (idx > half)
+        {
+            b = nb;
+            idx -= half;
+        }
+    }
+
+    memmove(&b->rows[idx + 1], &b->rows[idx], sizeof(erow *) * (b->nrows - idx));
+    b->rows[idx] = row;
+    row->blk = b;
+    b->nrows++;
+    ropeFixCounts(b, 1, row->size + 1);
+}
+
+// 从树中移除第 at 行并返回该行
+erow *ropeRemove(long long at)
+{
+    int idx;
+    rowblock *b = ropeFind(at, &idx);
+    erow *row = b->rows[idx];
+    memmove(&b->rows[idx], &b->rows[idx + 1], sizeof(erow *) * (b->nrows - idx - 1));
+    b->nrows--;
+    ropeFixCounts(b, -1, -(row->size + 1));
+
+    rowblock *next = ropeNext(b);
+    if (b->nrows == 0)
+    {
+        ropeRemoveBlock(b);
+    }
+    else if (next && b->nrows + next->nrows <= ROPE_BLOCK_ROWS / 2)
+    {
+        // 相邻的两个块都很稀疏时合并, 避免树中积累大量小块
+        memcpy(&b->rows[b->nrows], next->rows, sizeof(erow *) * next->nrows);
+        int i;
+        for (i = 0; i < next->nrows; i++)
+            next->rows[i]->blk = b;
+        ropeFixCounts(b, next->nrows, next->bytes);
+        b->nrows += next->nrows;
+        ropeRemoveBlock(next);
+    }
+    return row;
+}
+
+// 返回第 at 行, 越界时返回 NULL
+erow *editorRow(long long at)
+{
+    int idx;
+    if (at < 0 || at >= E.numrows)
+        return NULL;
+    rowblock *b = ropeFind(at, &idx);
+    return b->rows[idx];
+}
+
+// 行的长度改变了 delta 后更新字节统计
+void ropeRowResized(erow *row, long long delta)
+{
+    ropeFixCounts(row->blk, 0, delta);
+}
+
+// 第 at 行在整个缓冲区中的起始字节偏移
+long long ropeOffset(long long at)
+{
+    int idx;
+    rowblock *b = ropeFind(at, &idx);
+    if (!b)
+        return ropeSum(E.rope);
+    // 本块中前面的行, 加上整棵树中排在本块之前的块
+    long long off = ropeSum(b->left);
+    int i;
+    for (i = 0; i < idx; i++)
+        off += b->rows[i]->size + 1;
+    for (; b->parent; b = b->parent)
+    {
+        if (b->parent->right == b)
+            off += ropeSum(b->parent->left) + b->parent->bytes;
+    }
+    return off;
+}
+
+// 包含字节偏移 off 的行号, *col 为行内的偏移; 超出末尾时返回最后一行的行尾
+long long ropeFindOffset(long long off, long long *col)
+{
+    rowblock *b = E.rope;
+    long long at = 0;
+    while (b)
+    {
+        long long ls = ropeSum(b->left);
+        if (off < ls)
+        {
+            b = b->left;
+        }
+        else if (off < ls + b->bytes)
+        {
+            off -= ls;
+            at += ropeCount(b->left);
+            int i;
+            for (i = 0; off > b->rows[i]->size; i++)
+                off -= b->rows[i]->size + 1;
+            *col = off;
+            return at + i;
+        }
+        else
+        {
+            off -= ls + b->bytes;
+            at += ropeCount(b->left) + b->nrows;
+            b = b->right;
+        }
+    }
+    if (E.numrows == 0)
+    {
+        *col = 0;
+        return 0;
+    }
+    *col = editorRow(E.numrows - 1)->size;
+    return E.numrows - 1;
+}
+
+// 行的行号
+long long editorRowIndex(erow *row)
+{
+    int idx = 0;
+    while (row->blk->rows[idx] != row)
+        idx++;
+    return ropeBlockStart(row->blk) + idx;
+}
+
+// 从第 at 行开始按顺序遍历, 返回第一行
+erow *editorRowIterStart(rowiter *it, long long at)
+{
+    it->blk = (at >= 0 && at < E.numrows) ? ropeFind(at, &it->idx) : NULL;
+    return it->blk ? it->blk->rows[it->idx] : NULL;
+}
+
+erow *editorRowIterNext(rowiter *it)
+{
+    if (!it->blk)
+        return NULL;
+    if (++it->idx >= it->blk->nrows)
+    {
+        it->blk = ropeNext(it->blk);
+        it->idx = 0;
+    }
+    return it->blk ? it->blk->rows[it->idx] : NULL;
+}
+
+erow *editorRowIterPrev(rowiter *it)
+{
+    if (!it->blk)
+        return NULL;
+    if (--it->idx < 0)
+    {
+        it->blk = ropePrev(it->blk);
+        it->idx = it->blk ? it->blk->nrows - 1 : 0;
+    }
+    return it->blk ? it->blk->rows[it->idx] : NULL;
+}
+
+/******************** row operations ********************/
+
+// 行是否仍指向映射区; 工作线程用地址判断, 不读取主线程会修改的 flags
+int editorRowMapped(erow *row)
+{
+    return E.map && row->chars >= E.map && row->chars < E.map + E.mapsize;
+}
+
+// 行缓冲区是否被后台保存的快照引用着
+int editorRowShared(erow* row){
+    return E.save && !(row->flags & ROW_MAPPED) && row->gen <= E.save->gen;
+}
+
+// 修改前让行独占自己的缓冲区: 映射区中的行在第一次修改时复制出来,
+// 被快照引用的缓冲区复制一份再改, 旧的留给快照
+void editorRowOwn(erow* row){
+    if(editorRowShared(row)){
+        char* chars = rowAlloc(row->cap);
+        memcpy(chars, row->chars, row->cap);
+        saveDefer(E.save, row->chars, row->cap);
+        row->chars = chars;
+        row->gen = E.gen;
+        return;
+    }
+    if(!(row->flags & ROW_MAPPED)) return;
+    if(!editorRowMapped(row) && !E.view.on) rowTextDrop(row->size + 1); // 只读时文本不在 arena 中
+    long long cap = E.rowalloc->usable(row->size + 1);
+    char* chars = rowAlloc(cap);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    row->chars = chars;
+    row->cap = cap;
+    row->gap = row->size;
+    row->gen = E.gen;
+    row->flags &= ~ROW_MAPPED;
+}
+
+// 间隙的长度, 缓冲区最后一个字节留给 '\0'
+long long editorRowGapLen(erow* row){
+    return row->gap < row->size ? row->cap - row->size - 1 : 0;
+}
+
+// 把间隙移动到逻辑位置 at, 同一时刻只有一行的间隙不在行尾
+void editorRowMoveGap(erow* row, long long at){
+    if(row->flags & ROW_MAPPED) return;
+    if(E.gaprow && E.gaprow != row){
+        erow* old = E.gaprow;
+        E.gaprow = NULL;
+        editorRowMoveGap(old, old->size);
+    }
+    long long gaplen = row->cap - row->size - 1;
+    if(at < row->gap){
+        memmove(&row->chars[at + gaplen], &row->chars[at], row->gap - at);
+    }else if(at > row->gap){
+        memmove(&row->chars[row->gap], &row->chars[row->gap + gaplen], at - row->gap);
+    }
+    row->gap = at;
+    if(at == row->size){
+        row->chars[row->size] = '\0';
+        if(E.gaprow == row) E.gaprow = NULL;
+    }else{
+        E.gaprow = row;
+    }
+}
+
+// 保证间隙至少能容纳 len 个字符, 容量按倍数增长
+void editorRowReserve(erow* row, long long len){
+    long long gaplen = row->cap - row->size - 1;
+    if(gaplen >= len) return;
+    long long cap = row->cap * 2;
+    if(cap < row->size + len + 1) cap = row->size + len + 1;
+    cap = E.rowalloc->usable(cap < 16 ? 16 : cap);
+    // 间隙之前的内容留在开头, 之后的内容移到新缓冲区的末尾
+    char* chars = rowAlloc(cap);
+    long long tail = row->size - row->gap;
+    memcpy(chars, row->chars, row->gap);
+    memcpy(&chars[cap - 1 - tail], &row->chars[row->cap - 1 - tail], tail);
+    chars[cap - 1] = '\0';
+    if(tail == 0) chars[row->size] = '\0';
+    rowFree(row->chars, row->cap);
+    row->chars = chars;
+    row->cap = cap;
+}
+
+// 让行中的内容连续存放
+void editorCloseGap(){
+    if(E.gaprow) editorRowMoveGap(E.gaprow, E.gaprow->size);
+}
+
+// 解码行中第 at 个字节开始的字符
+int editorRowDecode(erow *row, long long at, int *cp)
+{
+    char buf[4];
+    int n = 0;
+    while (n < 4 && at + n < row->size)
+    {
+        buf[n] = ROWCHAR(row, at + n);
+        n++;
+    }
+    return utf8Decode(buf, n, cp);
+}
+
+// 第 j 个字节所在字符的首字节, 与 utf8Decode 的切分一致: 前面没有有效首字节的后续字节
+// 自成一个字符, 和显示时一样占一列
+long long editorRowCharStart(erow *row, long long j)
+{
+    long long k = j;
+    while (k > 0 && k > j - 3 && (ROWCHAR(row, k) & 0xc0) == 0x80)
+        k--;
+    unsigned char c = ROWCHAR(row, k);
+    int cp;
+    if (k < j && (c & 0xc0) == 0xc0 && k + editorRowDecode(row, k, &cp) > j)
+        return k;
+    return j;
+}
+
+// 经过第 j 个字节之后的 rx: 制表符跳到下一个制表位, 多字节字符的宽度算在首字节上
+long long editorRowAdvance(erow *row, long long j, long long rx)
+{
+    unsigned char c = ROWCHAR(row, j);
+    if (c == '\t')
+        return rx + QEDITOR_TAB_STOP - rx % QEDITOR_TAB_STOP;
+    if (c < 0x80)
+        return rx + 1;
+    if ((c & 0xc0) == 0x80 && editorRowCharStart(row, j) < j)
+        return rx;
+    int cp;
+    editorRowDecode(row, j, &cp);
+    return rx + charWidth(cp);
+}
+
+// cx 之前一个字符的首字节
+long long editorRowPrevChar(erow *row, long long cx)
+{
+    return cx > 0 ? editorRowCharStart(row, cx - 1) : 0;
+}
+
+// cx 之后下一个字素簇的起点
+long long editorRowNextCluster(erow *row, long long cx)
+{
+    int prev, cp;
+    cx += editorRowDecode(row, cx, &prev);
+    int regional = charRegional(prev);
+    while (cx < row->size)
+    {
+        int n = editorRowDecode(row, cx, &cp);
+        if (charRegional(cp) && regional == 1)
+            regional = 2; // 两个区域指示符组成一面旗帜
+        else if (!charExtends(cp) && prev != 0x200d)
+            break;
+        cx += n;
+        prev = cp;
+    }
+    return cx;
+}
+
+// cx 之前一个字素簇的起点
+long long editorRowPrevCluster(erow *row, long long cx)
+{
+    while (cx > 0)
+    {
+        cx = editorRowPrevChar(row, cx);
+        if (cx == 0)
+            break;
+        int cp, pcp;
+        editorRowDecode(row, cx, &cp);
+        long long pcx = editorRowPrevChar(row, cx);
+        editorRowDecode(row, pcx, &pcp);
+        if (charExtends(cp) || pcp == 0x200d)
+            continue;
+        if (charRegional(cp) && charRegional(pcp))
+        {
+            // 区域指示符从前往后两两配对, 前面有奇数个时与前一个组成一对
+            int k = 0;
+            long long at = cx;
+            while (at > 0)
+            {
+                at = editorRowPrevChar(row, at);
+                editorRowDecode(row, at, &pcp);
+                if (!charRegional(pcp))
+                    break;
+                k++;
+            }
+            if (k % 2 == 1)
+                cx = pcx;
+        }
+        break;
+    }
+    return cx;
+}
+
+// 查找长行的检查点, 没有时轮流替换一项
+colcache *editorColCache(erow *row)
+{
+    int i;
+    for (i = 0; i < QEDITOR_COL_ROWS; i++)
+        if (E.colcache[i].row == row)
+            return &E.colcache[i];
+
+    colcache *cc = &E.colcache[E.colhand];
+    E.colhand = (E.colhand + 1) % QEDITOR_COL_ROWS;
+    if (cc->cap == 0)
+    {
+        cc->cap = 16;
+        cc->rx = malloc(sizeof(long long) * cc->cap);
+    }
+    cc->row = row;
+    cc->n = 1;
+    cc->rx[0] = 0;
+    return cc;
+}
+
+// 从最后一个有效的检查点向后扫描, 补齐到第 k 个
+void editorColCacheExtend(colcache *cc, long long k)
+{
+    while (cc->n <= k)
+    {
+        if (cc->n == cc->cap)
+        {
+            cc->cap *= 2;
+            cc->rx = realloc(cc->rx, sizeof(long long) * cc->cap);
+        }
+        long long rx = cc->rx[cc->n - 1];
+        long long j;
+        for (j = (cc->n - 1) * QEDITOR_COL_STEP; j < cc->n * QEDITOR_COL_STEP; j++)
+            rx = editorRowAdvance(cc->row, j, rx);
+        cc->rx[cc->n++] = rx;
+    }
+}
+
+// 行在 at 处被修改, 只有 at 之后的检查点失效
+void editorColCacheInvalidate(erow *row, long long at)
+{
+    int i;
+    for (i = 0; i < QEDITOR_COL_ROWS; i++)
+    {
+        colcache *cc = &E.colcache[i];
+        if (cc->row == row && cc->n > at / QEDITOR_COL_STEP + 1)
+            cc->n = at / QEDITOR_COL_STEP + 1;
+    }
+}
+
+// 将制表符（\t）转换为相应的空格数量, 并按字符的显示宽度计算; 长行从最近的检查点开始计算
+long long editorRowCxToRx(erow *row, long long cx)
+{
+    if ((row->flags & (ROW_PLAIN | ROW_ASCII)) == (ROW_PLAIN | ROW_ASCII))
+        return cx;
+    long long rx = 0;
+    long long j = 0;
+    if (row->size >= QEDITOR_COL_STEP)
+    {
+        colcache *cc = editorColCache(row);
+        long long k = cx / QEDITOR_COL_STEP;
+        editorColCacheExtend(cc, k);
+        j = k * QEDITOR_COL_STEP;
+        rx = cc->rx[k];
+    }
+    for (; j < cx; j++)
+        rx = editorRowAdvance(row, j, rx);
+    return rx;
+}
+
+long long editorRowRxToCx(erow* row, long long rx){
+    if((row->flags & (ROW_PLAIN | ROW_ASCII)) == (ROW_PLAIN | ROW_ASCII))
+        return rx < row->size ? rx : row->size;
+    long long cur_rx = 0;
+    long long cx = 0;
+    if(row->size >= QEDITOR_COL_STEP){
+        // 检查点补到超过 rx 为止, 再二分找到 rx 之前最近的一个
+        colcache* cc = editorColCache(row);
+        long long last = row->size / QEDITOR_COL_STEP;
+        while(cc->n - 1 < last && cc->rx[cc->n - 1] <= rx)
+            editorColCacheExtend(cc, cc->n);
+        long long lo = 0, hi = cc->n - 1;
+        while(lo < hi){
+            long long mid = (lo + hi + 1) / 2;
+            if(cc->rx[mid] <= rx) lo = mid;
+            else hi = mid - 1;
+        }
+        cx = lo * QEDITOR_COL_STEP;
+        cur_rx = cc->rx[lo];
+    }
+    for(; cx<row->size; cx++){
+        cur_rx = editorRowAdvance(row, cx, cur_rx);
+        if(cur_rx > rx) return cx;
+    }
+
+    return cx;
+}
+
+// 行内容改变后使渲染结果失效, 真正的渲染推迟到该行需要显示时
+void editorUpdateRow(erow *row)
+{
+    row->flags &= ~ROW_RENDERED;
+    if (row->flags & ROW_PLAIN)
+        row->rsize = row->size;
+    editorSyntaxUpdateRow(row);
+}
+
+// 统计制表符数量, *ascii 表示是否只含 ASCII 字符
+long long editorRowScan(erow *row, int *ascii)
+{
+    long long tabs = 0;
+    char *p = row->chars;
+    char *end = row->chars + row->gap;
+    int seg;
+    *ascii = 1;
+    for (seg = 0; seg < 2; seg++)
+    {
+        if (*ascii && utf8HasHigh(p, end - p))
+            *ascii = 0;
+        while ((p = memchr(p, '\t', end - p)) != NULL)
+        {
+            tabs++;
+            p++;
+        }
+        p = row->chars + row->gap + editorRowGapLen(row);
+        end = p + (row->size - row->gap);
+    }
+    return tabs;
+}
+
+void editorRcacheRelease(erow *row)
+{
+    if (row->rslot < 0)
+        return;
+    E.rcache[row->rslot].row = NULL;
+    row->rslot = -1;
+    row->flags &= ~ROW_RENDERED;
+}
+
+// 为行分配一个缓存项, 缓存已满时按时钟算法淘汰最近没有使用过的一项
+rcacheslot *editorRcacheAlloc(erow *row)
+{
+    int victim;
+    for (;;)
+    {
+        victim = E.rchand;
+        E.rchand = (E.rchand + 1) % E.rcachelen;
+        if (!E.rcache[victim].row || !E.rcache[victim].ref)
+            break;
+        E.rcache[victim].ref = 0;
+    }
+    rcacheslot *slot = &E.rcache[victim];
+    if (slot->row)
+        editorRcacheRelease(slot->row);
+    slot->row = row;
+    row->rslot = victim;
+    return slot;
+}
+
+// 保证行的渲染结果可用: 没有制表符的行直接使用 chars, 否则展开到渲染缓存中
+void editorRowRender(erow *row)
+{
+    if (row->flags & ROW_PLAIN)
+    {
+        row->rsize = row->size;
+        return;
+    }
+    if (row->flags & ROW_RENDERED)
+    {
+        E.rcache[row->rslot].ref = 1;
+        return;
+    }
+
+    int ascii;
+    long long tabs = editorRowScan(row, &ascii); // 制表符数量
+    if (ascii)
+        row->flags |= ROW_ASCII;
+    if (tabs == 0)
+    {
+        editorRcacheRelease(row);
+        row->flags |= ROW_PLAIN;
+        row->rsize = row->size;
+        return;
+    }
+
+    rcacheslot *slot = row->rslot >= 0 ? &E.rcache[row->rslot] : editorRcacheAlloc(row);
+    slot->ref = 1;
+    // 原始文本字符数加上需要插入的空格数量, +1 是为了预留 '\0'结尾
+    long long need = row->size + tabs * (QEDITOR_TAB_STOP - 1) + 1;
+    if (need > slot->cap)
+    {
+        // 按倍数扩容, 缓存项被不同的行重复使用时不必每次都重新分配
+        slot->cap = need > slot->cap * 2 ? need : slot->cap * 2;
+        free(slot->render);
+        slot->render = malloc(slot->cap);
+    }
+
+    long long idx = 0; // 记录渲染数据数组的索引
+    long long col = 0; // 显示的列, 多字节字符和宽字符使列与 idx 不同
+    long long j;
+    for (j = 0; j < row->size; j++)
+    {
+        char c = ROWCHAR(row, j);
+        long long next = editorRowAdvance(row, j, col);
+        if (c == '\t')
+        {
+            while (col < next)
+            {
+                slot->render[idx++] = ' ';
+                col++;
+            }
+        }
+        else
+        {
+            slot->render[idx++] = c;
+            col = next;
+        }
+    }
+    slot->render[idx] = '\0';
+    row->rsize = idx;
+    row->flags |= ROW_RENDERED;
+}
+
+// 返回连续存放的渲染结果, 长度为 rsize
+char *editorRowRenderPtr(erow *row)
+{
+    editorRowRender(row);
+    if (row->flags & ROW_PLAIN)
+    {
+        if (row == E.gaprow)
+            editorCloseGap();
+        return row->chars;
+    }
+    return E.rcache[row->rslot].render;
+}
+
+// 创建一行, 映射区和 arena 中的行 cap 为 0
+erow *editorNewRow(char *chars, size_t len, long long cap, int flags)
+{
+    erow *row = rowAlloc(sizeof(erow));
+    row->size = len;
+    row->chars = chars;
+    row->cap = cap;
+    row->gap = len;
+    row->rsize = 0;
+    row->rslot = -1;
+    row->flags = flags;
+    row->gen = E.gen;
+    row->hlstate = HLS_UNKNOWN;
+    return row;
+}
+
+void editorInsertRow(long long at, const char *s, size_t len)
+{
+    if(at<0 || at>E.numrows) return;
+
+    long long cap = E.rowalloc->usable(len + 1);
+    char* chars = rowAlloc(cap);
+    memcpy(chars, s, len);
+    chars[len] = '\0';
+
+    ropeInsert(at, editorNewRow(chars, len, cap, 0));
+    E.numrows++;
+    editorSyntaxInsertRow(at);
+    E.dirty++;
+    editorUndoRecord(UNDO_INSROW, at, 0, s, len, 0);
+}
+
+void editorFreeRow(erow* row){
+    if(E.gaprow == row) E.gaprow = NULL;
+    // 行结构的内存会被复用, 检查点不能留到下一行
+    int i;
+    for(i = 0; i < QEDITOR_COL_ROWS; i++)
+        if(E.colcache[i].row == row) E.colcache[i].row = NULL;
+    editorRcacheRelease(row);
+    if(editorRowShared(row)) saveDefer(E.save, row->chars, row->cap);
+    else if(!(row->flags & ROW_MAPPED)) rowFree(row->chars, row->cap);
+    else if(!editorRowMapped(row) && !E.view.on) rowTextDrop(row->size + 1); // 只读时文本不在 arena 中
+}
+
+void editorDelRow(long long at){
+    if(at<0 || at>=E.numrows) return;
+    erow* row = ropeRemove(at);
+    editorRowMoveGap(row, row->size);
+    editorUndoRecord(UNDO_DELROW, at, 0, row->chars, row->size, 0);
+    editorFreeRow(row);
+    rowFree(row, sizeof(erow));
+    E.numrows--;
+    E.dirty++;
+    editorSyntaxDelRow(at);
+}
+
+void editorRowInsertChar(erow *row, long long at, int c)
+{
+    if (at < 0 || at > row->size)
+        at = row->size;
+    char ch = c;
+    editorUndoRecord(UNDO_INSERT, editorRowIndex(row), at, &ch, 1, 1);
+    editorColCacheInvalidate(row, at);
+    editorRowOwn(row);
+    // 把间隙移到插入位置, 新字符直接写入间隙
+    editorRowReserve(row, 1);
+    editorRowMoveGap(row, at);
+    row->chars[row->gap++] = c;
+    row->size++;
+    ropeRowResized(row, 1);
+    if (c == '\t')
+        row->flags &= ~ROW_PLAIN;
+    if (c & 0x80)
+        row->flags &= ~ROW_ASCII;
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+// 在 at 处插入一段文本, 粘贴和重做时使用
+void editorRowInsertString(erow* row, long long at, const char* s, size_t len){
+    if(at < 0 || at > row->size) at = row->size;
+    editorUndoRecord(UNDO_INSERT, editorRowIndex(row), at, s, len, 0);
+    editorColCacheInvalidate(row, at);
+    editorRowOwn(row);
+    editorRowReserve(row, len);
+    editorRowMoveGap(row, at);
+    memcpy(&row->chars[row->gap], s, len);
+    row->gap += len;
+    row->size += len;
+    ropeRowResized(row, len);
+    if(memchr(s, '\t', len)) row->flags &= ~ROW_PLAIN;
+    if(utf8HasHigh(s, len)) row->flags &= ~ROW_ASCII;
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+void EditorRowApendString(erow* row, char* s, size_t len){
+    editorUndoRecord(UNDO_INSERT, editorRowIndex(row), row->size, s, len, 0);
+    editorColCacheInvalidate(row, row->size);
+    editorRowOwn(row);
+    editorRowReserve(row, len);
+    editorRowMoveGap(row, row->size);
+    memcpy(&row->chars[row->size], s, len);
+    if(memchr(s, '\t', len)) row->flags &= ~ROW_PLAIN;
+    if(utf8HasHigh(s, len)) row->flags &= ~ROW_ASCII;
+    row->size += len;
+    row->gap = row->size;
+    ropeRowResized(row, len);
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+void editorRowDelChar(erow* row, long long at){
+    if(at<0 || at>= row->size) return;
+    char ch = ROWCHAR(row, at);
+    editorUndoRecord(UNDO_DELETE, editorRowIndex(row), at, &ch, 1, 1);
+    editorColCacheInvalidate(row, at);
+    editorRowOwn(row);
+    // 被删除的字符并入间隙
+    editorRowMoveGap(row, at+1);
+    row->gap--;
+    row->size--;
+    ropeRowResized(row, -1);
+    if(row->gap == row->size){
+        row->chars[row->size] = '\0';
+        if(E.gaprow == row) E.gaprow = NULL;
+    }
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+
+/******************** syntax highlighting ********************/
+/*
+每行记录行末的词法状态 (是否在多行注释中)。修改一行后, 从这一行开始向后重新计算状态,
+直到某一行算出的状态与记录的相同且之后的行没有被修改过, 后面的行就不受影响了。
+状态只在绘制时计算到屏幕最后一行, 每行的高亮结果也只为显示的行计算, 不保存。
+*/
+
+int is_separator(int c)
+{
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}:&|!^?", c) != NULL;
+}
+
+// 从状态 state 开始分析 s 的前 len 个字节, 返回行末状态; hl 不为 NULL 时写入每个字节的高亮类型
+int editorSyntaxLex(const char *s, long long len, int state, unsigned char *hl)
+{
+    const syntaxdef *syn = E.syntax;
+    const char *scs = syn->singleline_comment_start;
+    const char *mcs = syn->multiline_comment_start;
+    const char *mce = syn->multiline_comment_end;
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    if (hl)
+        memset(hl, HL_NORMAL, len);
+    int prev_sep = 1;
+    int in_string = 0;
+    int in_comment = state == HLS_COMMENT;
+    long long i = 0;
+    while (i < len)
+    {
+        char c = s[i];
+        unsigned char prev_hl = hl && i > 0 ? hl[i - 1] : HL_NORMAL;
+
+        if (scs_len && !in_string && !in_comment && len - i >= scs_len &&
+            !strncmp(&s[i], scs, scs_len))
+        {
+            if (hl)
+                memset(&hl[i], HL_COMMENT, len - i);
+            break;
+        }
+
+        if (mcs_len && mce_len && !in_string)
+        {
+            if (in_comment)
+            {
+                if (len - i >= mce_len && !strncmp(&s[i], mce, mce_len))
+                {
+                    if (hl)
+                        memset(&hl[i], HL_MLCOMMENT, mce_len);
+                    i += mce_len;
+                    in_comment = 0;
+                    prev_sep = 1;
+                    continue;
+                }
+                if (hl)
+                    hl[i] = HL_MLCOMMENT;
+                i++;
+                continue;
+            }
+            else if (len - i >= mcs_len && !strncmp(&s[i], mcs, mcs_len))
+            {
+                if (hl)
+                    memset(&hl[i], HL_MLCOMMENT, mcs_len);
+                i += mcs_len;
+                in_comment = 1;
+                continue;
+            }
+        }
+
+        if (syn->flags & HL_HIGHLIGHT_STRINGS)
+        {
+            if (in_string)
+            {
+                if (hl)
+                    hl[i] = HL_STRING;
+                if (c == '\\' && i + 1 < len)
+                {
+                    if (hl)
+                        hl[i + 1] = HL_STRING;
+                    i += 2;
+                    continue;
+                }
+                if (c == in_string)
+                    in_string = 0;
+                i++;
+                prev_sep = 1;
+                continue;
+            }
+            else if (c == '"' || c == '\'')
+            {
+                in_string = c;
+                if (hl)
+                    hl[i] = HL_STRING;
+                i++;
+                continue;
+            }
+        }
+
+        // 数字和关键字不影响行末状态, 只计算状态时跳过
+        if (hl && (syn->flags & HL_HIGHLIGHT_NUMBERS))
+        {
+            if ((isdigit((unsigned char)c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+                (c == '.' && prev_hl == HL_NUMBER))
+            {
+                hl[i] = HL_NUMBER;
+                i++;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        if (hl && prev_sep)
+        {
+            int j;
+            for (j = 0; syn->keywords[j]; j++)
+            {
+                int klen = strlen(syn->keywords[j]);
+                int kw2 = syn->keywords[j][klen - 1] == '|';
+                if (kw2)
+                    klen--;
+                if (len - i >= klen && !strncmp(&s[i], syn->keywords[j], klen) &&
+                    (i + klen == len || is_separator((unsigned char)s[i + klen])))
+                {
+                    memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+                    i += klen;
+                    break;
+                }
+            }
+            if (syn->keywords[j] != NULL)
+            {
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        prev_sep = is_separator((unsigned char)c);
+        i++;
+    }
+    return in_comment ? HLS_COMMENT : HLS_NORMAL;
+}
+
+// 行的连续内容, 用于词法分析
+const char *editorSyntaxText(erow *row)
+{
+    if (row == E.gaprow)
+        editorCloseGap();
+    return row->chars;
+}
+
+// 保证前 upto 行的行末状态都是正确的
+void editorSyntaxSync(long long upto)
+{
+    // 没有多行注释的语言, 每行都从 HLS_NORMAL 开始
+    if (!E.syntax || !E.syntax->multiline_comment_start)
+        return;
+    if (upto > E.numrows)
+        upto = E.numrows;
+    if (E.hlfrom >= upto)
+        return;
+
+    long long i = E.hlfrom;
+    int state = i > 0 ? editorRow(i - 1)->hlstate : HLS_NORMAL;
+    rowiter it;
+    erow *row = editorRowIterStart(&it, i);
+    for (; i < upto; i++, row = editorRowIterNext(&it))
+    {
+        int old = row->hlstate;
+        state = editorSyntaxLex(editorSyntaxText(row), row->size, state, NULL);
+        row->hlstate = state;
+        if (state == old && i + 1 >= E.hlstale && i + 1 < E.hlvalid)
+        {
+            // 之后的行没有被修改过, 开始时的状态也没变, 记录的状态仍然正确
+            E.hlfrom = E.hlstale = E.hlvalid;
+            return;
+        }
+    }
+    E.hlfrom = upto;
+    if (E.hlstale < upto)
+        E.hlstale = upto;
+    if (E.hlvalid < upto)
+        E.hlvalid = upto;
+}
+
+// 标记第 at 行的内容被修改过
+void editorSyntaxInvalidate(long long at)
+{
+    if (at >= E.hlvalid)
+        return;
+    if (E.hlfrom > at)
+        E.hlfrom = at;
+    if (E.hlstale < at + 1)
+        E.hlstale = at + 1;
+}
+
+void editorSyntaxUpdateRow(erow *row)
+{
+    if (E.syntax && E.syntax->multiline_comment_start)
+        editorSyntaxInvalidate(editorRowIndex(row));
+}
+
+void editorSyntaxInsertRow(long long at)
+{
+    if (at >= E.hlvalid)
+        return;
+    E.hlvalid++;
+    if (E.hlstale > at)
+        E.hlstale++;
+    if (E.hlfrom > at)
+        E.hlfrom++;
+    editorSyntaxInvalidate(at);
+}
+
+void editorSyntaxDelRow(long long at)
+{
+    if (at >= E.hlvalid)
+        return;
+    E.hlvalid--;
+    if (E.hlstale > at)
+        E.hlstale--;
+    if (E.hlfrom > at)
+        E.hlfrom = at;
+    if (E.hlfrom > E.hlvalid)
+        E.hlfrom = E.hlvalid;
+    if (E.hlstale < E.hlfrom)
+        E.hlstale = E.hlfrom;
+}
+
+// 第 at 行开始时的词法状态, 调用前需要 editorSyntaxSync
+int editorSyntaxState(long long at)
+{
+    if (at == 0 || !E.syntax->multiline_comment_start)
+        return HLS_NORMAL;
+    return editorRow(at - 1)->hlstate;
+}
+
+int editorSyntaxToColor(int hl)
+{
+    switch (hl)
+    {
+    case HL_COMMENT:
+    case HL_MLCOMMENT:
+        return 36;
+    case HL_KEYWORD1:
+        return 33;
+    case HL_KEYWORD2:
+        return 32;
+    case HL_STRING:
+        return 35;
+    case HL_NUMBER:
+        return 31;
+    default:
+        return 39;
+    }
+}
+
+// 根据文件名选择高亮规则, 已有的行末状态全部作废
+void editorSelectSyntaxHighlight()
+{
+    E.syntax = NULL;
+    E.hlfrom = E.hlstale = E.hlvalid = 0;
+    if (E.filename == NULL)
+        return;
+
+    char *ext = strrchr(E.filename, '.');
+    unsigned int j;
+    for (j = 0; j < HLDB_ENTRIES; j++)
+    {
+        const syntaxdef *s = &HLDB[j];
+        int i;
+        for (i = 0; s->filematch[i]; i++)
+        {
+            int is_ext = s->filematch[i][0] == '.';
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                (!is_ext && strstr(E.filename, s->filematch[i])))
+            {
+                E.syntax = s;
+                return;
+            }
+        }
+    }
+}
+
+/******************** editor operations ********************/
+void editorInsertChar(int c)
+{
+    if (E.cy == E.numrows)
+    {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    editorRowInsertChar(editorRow(E.cy), E.cx, c);
+    E.cx++;
+}
+
+void editorInsertNewline(){
+    if(E.cx == 0){
+        //所在行之前插入一个新空行
+        editorInsertRow(E.cy, "", 0);
+    }else{
+        erow* row = editorRow(E.cy);
+        editorRowOwn(row);
+        // 间隙移到光标处之后, 光标后面的内容是连续的
+        editorRowMoveGap(row, E.cx);
+        char* tail = &row->chars[E.cx + editorRowGapLen(row)];
+        editorInsertRow(E.cy+1, tail, row->size - E.cx);
+        editorUndoRecord(UNDO_DELETE, E.cy, E.cx, tail, row->size - E.cx, 0);
+        ropeRowResized(row, E.cx - row->size);
+        editorColCacheInvalidate(row, E.cx);
+        row->size = E.cx;
+        row->chars[row->size] = '\0';
+        if(E.gaprow == row) E.gaprow = NULL;
+        editorUpdateRow(row);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+// 插入一段文本, \r、\n 和 \r\n 都作为换行; 每一行的文本一次插入。
+// 光标所在的行只在第一个换行处分开一次, 中间的行直接插在分出的后半行之前,
+// 最后一段插到后半行的开头, 所以光标后面的内容只复制一次
+void editorInsertText(const char* s, size_t len){
+    size_t i = 0;
+    int split = 0;
+    while(i < len){
+        size_t j = i;
+        while(j < len && s[j] != '\r' && s[j] != '\n') j++;
+        if(split && j < len){
+            editorInsertRow(E.cy, &s[i], j - i);
+            E.cy++;
+        }else if(j > i){
+            if(E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+            editorRowInsertString(editorRow(E.cy), E.cx, &s[i], j - i);
+            E.cx += j - i;
+        }
+        if(j < len){
+            if(!split) editorInsertNewline();
+            split = 1;
+            if(s[j] == '\r' && j + 1 < len && s[j + 1] == '\n') j++;
+            j++;
+        }
+        i = j;
+    }
+}
+
+void editorDelChar(){
+    if(E.cy == E.numrows) return;
+    if(E.cx == 0 && E.cy == 0) return;
+
+    erow* row = editorRow(E.cy);
+    if(E.cx >0){
+        // 删除光标前的整个字素簇
+        long long start = editorRowPrevCluster(row, E.cx);
+        while(E.cx > start){
+            editorRowDelChar(row, E.cx - 1);
+            E.cx--;
+        }
+    }else{
+        erow* prev = editorRow(E.cy-1);
+        editorRowMoveGap(row, row->size);
+        E.cx = prev->size;
+        EditorRowApendString(prev, row->chars, row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+
+/******************** undo ********************/
+/*
+撤销日志按顺序记录对行的每一次修改, 行用行号表示。连续输入或删除的字符合并成一条记录,
+文本追加到一块连续的 arena 中; 超过内存上限时整组淘汰最早的记录, 被淘汰部分的空间在
+需要扩容时回收。
+*/
+
+// 日志当前占用的内存
+size_t undoUsage(undolog *u)
+{
+    size_t live = u->first < u->nrecs ? u->aend - u->recs[u->first].off : 0;
+    return live + sizeof(undorec) * (u->nrecs - u->first);
+}
+
+// 为一条记录和 n 字节文本预留空间, 被淘汰的部分超过一半时先回收它们的空间
+void undoReserve(undolog *u, size_t n)
+{
+    if (u->nrecs == u->cap)
+    {
+        if (u->first >= u->cap / 2 && u->first > 0)
+        {
+            memmove(u->recs, &u->recs[u->first], sizeof(undorec) * (u->nrecs - u->first));
+            u->pos -= u->first;
+            u->nrecs -= u->first;
+            u->first = 0;
+        }
+        else
+        {
+            u->cap = u->cap ? u->cap * 2 : 64;
+            u->recs = realloc(u->recs, sizeof(undorec) * u->cap);
+        }
+    }
+    if (u->aend - u->abase + n > u->acap)
+    {
+        size_t live = u->first < u->nrecs ? u->recs[u->first].off : u->aend;
+        if (live - u->abase >= u->acap / 2 && live > u->abase)
+        {
+            memmove(u->arena, u->arena + (live - u->abase), u->aend - live);
+            u->abase = live;
+        }
+        if (u->aend - u->abase + n > u->acap)
+        {
+            u->acap = u->acap ? u->acap * 2 : 4096;
+            if (u->acap < u->aend - u->abase + n)
+                u->acap = u->aend - u->abase + n;
+            u->arena = realloc(u->arena, u->acap);
+        }
+    }
+}
+
+// 超过上限时从最早的记录开始整组淘汰, 正在记录的一组保留到下一次按键
+void undoEvict(undolog *u)
+{
+    while (u->first < u->nrecs && u->recs[u->first].group != u->group && undoUsage(u) > u->limit)
+    {
+        unsigned group = u->recs[u->first].group;
+        while (u->first < u->nrecs && u->recs[u->first].group == group)
+            u->first++;
+    }
+    if (u->first == u->nrecs)
+    {
+        u->first = u->pos = u->nrecs = 0;
+        u->abase = u->aend;
+    }
+}
+
+// 尝试把单个字符并入上一条记录, 上一条必须来自上一次按键且位置相连
+int undoCoalesce(undolog *u, int type, long long row, long long col, char c)
+{
+    if (u->nrecs == u->first)
+        return 0;
+    undorec *last = &u->recs[u->nrecs - 1];
+    if (!last->run || last->type != type || last->row != row || last->group + 1 != u->group)
+        return 0;
+
+    // 插入和向后删除时字符接在后面, 退格删除时在前面
+    int append = type == UNDO_INSERT ? col == last->col + last->len : col == last->col;
+    int prepend = type == UNDO_DELETE && col + 1 == last->col;
+    if (!append && !prepend)
+        return 0;
+
+    undoReserve(u, 1);
+    last = &u->recs[u->nrecs - 1];
+    char *text = u->arena + (last->off - u->abase);
+    if (prepend)
+    {
+        memmove(text + 1, text, last->len);
+        text[0] = c;
+        last->col = col;
+    }
+    else
+    {
+        text[last->len] = c;
+    }
+    last->len++;
+    last->group = u->group;
+    u->aend++;
+    return 1;
+}
+
+// 记录一次修改, 由行操作函数调用; 新的修改使之前撤销的记录不能再重做
+void editorUndoRecord(int type, long long row, long long col, const char *s, long long len, int run)
+{
+    undolog *u = &E.undo;
+    if (u->suspend)
+        return;
+    if (u->pos < u->nrecs)
+    {
+        u->aend = u->recs[u->pos].off;
+        u->nrecs = u->pos;
+    }
+    if (!(run && undoCoalesce(u, type, row, col, s[0])))
+    {
+        undoReserve(u, len);
+        undorec *r = &u->recs[u->nrecs++];
+        r->type = type;
+        r->run = run;
+        r->group = u->group;
+        r->row = row;
+        r->col = col;
+        r->len = len;
+        r->off = u->aend;
+        r->bcx = r->acx = u->cx;
+        r->bcy = r->acy = u->cy;
+        memcpy(u->arena + (u->aend - u->abase), s, len);
+        u->aend += len;
+    }
+    u->pos = u->nrecs;
+    undoEvict(u);
+}
+
+// 丢弃全部记录, 用于不能记录的修改之后
+void editorUndoReset()
+{
+    undolog *u = &E.undo;
+    u->first = u->pos = u->nrecs = 0;
+    u->abase = u->aend;
+}
+
+// 每次按键开始时调用, 之后产生的记录属于同一组
+void editorUndoBegin()
+{
+    E.undo.group++;
+    E.undo.cx = E.cx;
+    E.undo.cy = E.cy;
+}
+
+// 按键处理完后记下光标位置, 重做时恢复
+void editorUndoEnd()
+{
+    undolog *u = &E.undo;
+    if (u->nrecs > u->first && u->recs[u->nrecs - 1].group == u->group)
+    {
+        u->recs[u->nrecs - 1].acx = E.cx;
+        u->recs[u->nrecs - 1].acy = E.cy;
+    }
+}
+
+// 执行一条记录, inverse 为 1 时执行它的逆操作
+void undoApply(undorec *r, int inverse)
+{
+    char *text = E.undo.arena + (r->off - E.undo.abase);
+    int type = inverse ? r->type ^ 1 : r->type;
+    long long i;
+    switch (type)
+    {
+    case UNDO_INSERT:
+        editorRowInsertString(editorRow(r->row), r->col, text, r->len);
+        break;
+    case UNDO_DELETE:
+        for (i = 0; i < r->len; i++)
+            editorRowDelChar(editorRow(r->row), r->col);
+        break;
+    case UNDO_INSROW:
+        editorInsertRow(r->row, text, r->len);
+        break;
+    case UNDO_DELROW:
+        editorDelRow(r->row);
+        break;
+    }
+}
+
+void editorUndo()
+{
+    undolog *u = &E.undo;
+    if (u->pos == u->first)
+    {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    unsigned group = u->recs[u->pos - 1].group;
+    u->suspend++;
+    while (u->pos > u->first && u->recs[u->pos - 1].group == group)
+    {
+        u->pos--;
+        undoApply(&u->recs[u->pos], 1);
+    }
+    u->suspend--;
+    E.cx = u->recs[u->pos].bcx;
+    E.cy = u->recs[u->pos].bcy;
+}
+
+void editorRedo()
+{
+    undolog *u = &E.undo;
+    if (u->pos == u->nrecs)
+    {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    unsigned group = u->recs[u->pos].group;
+    u->suspend++;
+    while (u->pos < u->nrecs && u->recs[u->pos].group == group)
+    {
+        undoApply(&u->recs[u->pos], 0);
+        u->pos++;
+    }
+    u->suspend--;
+    E.cx = u->recs[u->pos - 1].acx;
+    E.cy = u->recs[u->pos - 1].acy;
+}
+
+
+/******************** file i/o ********************/
+//缓冲区 erow 的数组转换单独字符串
+char* editorRowsToString(size_t* buflen){
+    size_t totlen = 0;
+    rowiter it;
+    erow* row;
+    editorLoadAll();
+    editorCloseGap();
+    for(row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it)){
+        totlen += row->size+1;
+    }
+    *buflen = totlen;
+
+    char* buf = malloc(totlen);
+    char* p = buf;
+    for(row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it)){
+        memcpy(p, row->chars, row->size);
+        p+=row->size;
+        *p='\n';
+        p++;
+    }
+    return buf;
+}
+
+/*
+打开文件时由载入线程在后台切分行, 主线程在空闲时把切分好的行插入行树, 所以首屏很快
+就能显示并开始操作。需要还没有载入的行时 (跳转、翻页、查找越过已载入的部分) 只等待
+载入线程交出下一批。普通文件用 mmap 映射, 行直接指向映射区; 其他文件 (管道等) 用
+read 按块读取, 行的文本复制到行内存中。行树只由主线程修改。
+*/
+
+// 是否还有尚未载入的行
+int editorLoading()
+{
+    return E.load != NULL;
+}
+
+// 已载入的字节数占文件大小的百分比, 大小未知时为 -1
+int editorLoadPercent()
+{
+    loadjob *job = E.load;
+    return job->size ? (int)(job->loaded * 100 / job->size) : -1;
+}
+
+loadchunk *loadNewChunk(char *base, int owned)
+{
+    loadchunk *chunk = malloc(sizeof(loadchunk));
+    chunk->next = NULL;
+    chunk->base = base;
+    chunk->owned = owned;
+    chunk->off = NULL;
+    chunk->len = NULL;
+    chunk->nlines = 0;
+    chunk->cap = 0;
+    chunk->bytes = 0;
+    return chunk;
+}
+
+void loadFreeChunk(loadchunk *chunk)
+{
+    if (chunk->owned)
+        free(chunk->base);
+    free(chunk->off);
+    free(chunk->len);
+    free(chunk);
+}
+
+// 把 base 中 [from, end) 切分成行加入 chunk, 最多 max 行, 返回切分到的位置;
+// eof 为 0 时末尾没有换行符的不完整行留给下一次
+size_t loadScan(loadchunk *chunk, size_t from, size_t end, int max, int eof)
+{
+    size_t pos = from;
+    while (pos < end && chunk->nlines < max)
+    {
+        char *line = chunk->base + pos;
+        char *nl = memchr(line, '\n', end - pos);
+        if (!nl && !eof)
+            break;
+        size_t linelen = nl ? (size_t)(nl - line) : end - pos;
+        size_t next = pos + linelen + (nl ? 1 : 0);
+        while (linelen > 0 && line[linelen - 1] == '\r')
+            linelen--;
+
+        if (chunk->nlines == chunk->cap)
+        {
+            chunk->cap = chunk->cap ? chunk->cap * 2 : 1024;
+            chunk->off = realloc(chunk->off, sizeof(size_t) * chunk->cap);
+            chunk->len = realloc(chunk->len, sizeof(long long) * chunk->cap);
+        }
+        chunk->off[chunk->nlines] = pos;
+        chunk->len[chunk->nlines] = linelen;
+        chunk->nlines++;
+        pos = next;
+    }
+    chunk->bytes += pos - from;
+    return pos;
+}
+
+// 把一批行放进队列, 唤醒主线程
+void loadPush(loadjob *job, loadchunk *chunk)
+{
+    pthread_mutex_lock(&job->lock);
+    if (job->tail)
+        job->tail->next = chunk;
+    else
+        job->head = chunk;
+    job->tail = chunk;
+    pthread_cond_signal(&job->ready);
+    pthread_mutex_unlock(&job->lock);
+    editorWake();
+}
+
+// 切分映射区, 第一批较小, 让首屏尽快显示
+void loadMapped(loadjob *job)
+{
+    size_t pos = 0;
+    int max = QEDITOR_LOAD_CHUNK;
+    while (pos < job->size)
+    {
+        loadchunk *chunk = loadNewChunk(job->map, 0);
+        pos = loadScan(chunk, pos, job->size, max, 1);
+        loadPush(job, chunk);
+        max = QEDITOR_LOAD_BATCH;
+    }
+}
+
+// 按块读取不能映射的文件, 每块中完整的行成为一批, 不完整的行移到下一块的开头
+void loadRead(loadjob *job)
+{
+    size_t cap = QEDITOR_LOAD_BLOCK / 16;
+    size_t len = 0;
+    char *buf = malloc(cap);
+    int eof = 0;
+    while (!eof)
+    {
+        ssize_t n = read(job->fd, buf + len, cap - len);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            job->err = errno;
+            break;
+        }
+        if (n == 0)
+            eof = 1;
+        len += n;
+        if (!eof && len < cap)
+            continue;
+
+        loadchunk *chunk = loadNewChunk(buf, 1);
+        size_t pos = loadScan(chunk, 0, len, INT_MAX, eof);
+        if (chunk->nlines == 0)
+        {
+            // 一行比整块还长, 扩大缓冲区后继续读
+            chunk->owned = 0;
+            loadFreeChunk(chunk);
+            if (!eof)
+            {
+                cap *= 2;
+                buf = realloc(buf, cap);
+            }
+            continue;
+        }
+        size_t rest = len - pos;
+        cap = rest * 2 > QEDITOR_LOAD_BLOCK ? rest * 2 : QEDITOR_LOAD_BLOCK;
+        buf = malloc(cap);
+        memcpy(buf, chunk->base + pos, rest);
+        len = rest;
+        loadPush(job, chunk);
+    }
+    free(buf);
+}
+
+void *loadWorker(void *arg)
+{
+    loadjob *job = arg;
+    if (job->map)
+        loadMapped(job);
+    else
+        loadRead(job);
+
+    pthread_mutex_lock(&job->lock);
+    job->done = 1;
+    pthread_cond_signal(&job->ready);
+    pthread_mutex_unlock(&job->lock);
+    editorWake();
+    return NULL;
+}
+
+// 把一批行追加到行树的末尾
+void editorLoadChunk(loadjob *job, loadchunk *chunk)
+{
+    int i;
+    for (i = 0; i < chunk->nlines; i++)
+    {
+        char *line = chunk->base + chunk->off[i];
+        long long len = chunk->len[i];
+        erow *row;
+        if (!chunk->owned || E.view.on)
+        {
+            row = editorNewRow(line, len, 0, ROW_MAPPED);
+        }
+        else if (E.rowalloc->text)
+        {
+            // 文本连续地存放在 arena 中, 第一次修改时再复制
+            char *chars = E.rowalloc->text(len + 1);
+            memcpy(chars, line, len);
+            chars[len] = '\0';
+            row = editorNewRow(chars, len, 0, ROW_MAPPED);
+        }
+        else
+        {
+            long long cap = E.rowalloc->usable(len + 1);
+            char *chars = rowAlloc(cap);
+            memcpy(chars, line, len);
+            chars[len] = '\0';
+            row = editorNewRow(chars, len, cap, 0);
+        }
+        ropeInsert(E.numrows, row);
+        E.numrows++;
+    }
+
+    // 载入耗时按墙上时间计算, 包括载入线程扫描和等待读取的时间
+    long long now = editorNowNs();
+    job->loaded += chunk->bytes;
+    E.prof.loadbytes += chunk->bytes;
+    E.prof.loadns += now - job->last;
+    job->last = now;
+    if (E.view.on)
+        chunk->owned = 0; // 只读时行直接指向读取缓冲区, 缓冲区和映射区一样保留到退出
+    loadFreeChunk(chunk);
+    searchExtend();
+}
+
+// 载入线程已结束并且队列已取空, 回收载入线程
+void editorLoadFinish()
+{
+    loadjob *job = E.load;
+    pthread_join(job->thread, NULL);
+    if (job->fd != -1)
+        close(job->fd);
+    if (job->err)
+        editorSetStatusMessage("Read error: %s", strerror(job->err));
+    if (E.view.fd != -1)
+        editorFollowLoaded(job->loaded);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->ready);
+    free(job);
+    E.load = NULL;
+}
+
+// 取出一批行插入行树, wait 为 1 时等待载入线程交出下一批; 有新的行或载入结束时返回 1
+int editorLoadStep(int wait)
+{
+    loadjob *job = E.load;
+    pthread_mutex_lock(&job->lock);
+    while (wait && !job->head && !job->done)
+        pthread_cond_wait(&job->ready, &job->lock);
+    loadchunk *chunk = job->head;
+    if (chunk)
+    {
+        job->head = chunk->next;
+        if (!job->head)
+            job->tail = NULL;
+    }
+    int done = job->done && !job->head;
+    pthread_mutex_unlock(&job->lock);
+
+    if (chunk)
+        editorLoadChunk(job, chunk);
+    if (done)
+        editorLoadFinish();
+    return chunk || done;
+}
+
+// 等待载入, 直到第 upto 行可用或到达文件末尾
+void editorLoadRows(long long upto)
+{
+    if (!editorLoading() || E.numrows > upto)
+        return;
+    // 查找线程在读行树时不能插入新的行; 每批行插入后 searchExtend 会再唤醒它们, 所以每批之前都要等
+    while (editorLoading() && E.numrows <= upto)
+    {
+        searchWaitIdle();
+        editorLoadStep(1);
+    }
+}
+
+// 载入剩余全部的行
+void editorLoadAll()
+{
+    editorLoadRows(LLONG_MAX - 1);
+}
+
+// 主循环空闲时每次插入一批已经切分好的行, 有新的行时返回 1
+int editorLoadPoll()
+{
+    if (!editorLoading() || !searchIdle())
+        return 0;
+    int changed = editorLoadStep(0);
+    if (changed && editorLoading())
+        editorWake(); // 队列中可能还有, 下一轮继续
+    return changed;
+}
+
+// 普通文件使用 mmap 映射, 行直接指向映射区
+int editorMapFile(loadjob *job)
+{
+    struct stat st;
+    if (fstat(job->fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return -1;
+    job->size = st.st_size;
+    if (st.st_size == 0)
+        return -1;
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, job->fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    E.map = map;
+    E.mapsize = st.st_size;
+    E.mapdev = st.st_dev;
+    E.mapino = st.st_ino;
+    job->map = map;
+    close(job->fd);
+    job->fd = -1;
+    return 0;
+}
+
+// 打开文件, 启动载入线程, 等首屏的行载入后返回
+void editorOpen(char *filename)
+{
+    free(E.filename);
+    E.filename = strdup(filename);
+    editorSelectSyntaxHighlight();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        die("open");
+
+    loadjob *job = calloc(1, sizeof(loadjob));
+    job->fd = fd;
+    fstat(fd, &E.disk);
+    editorWatchStart();
+    // 跟随的文件可能被截断, 映射区超出新长度的部分访问时会收到 SIGBUS, 所以用 read;
+    // 载入结束后用复制的 fd 接着读新增的内容
+    if (E.view.follow)
+        E.view.fd = dup(fd);
+    else
+        editorMapFile(job);
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->ready, NULL);
+    job->last = editorNowNs();
+    E.load = job;
+    if (pthread_create(&job->thread, NULL, loadWorker, job) != 0)
+        die("pthread_create");
+
+    editorLoadRows(E.screenrows);
+    E.dirty = 0;
+}
+
+/*
+打开的文件由 inotify 监视: 文件本身 (写入、截断、移走、删除) 和所在的目录 (按原名新建或
+改名替换)。事件只表示文件可能有变化, 主循环空闲时再检查。没有 inotify 时定期检查。
+*/
+
+// 监视文件名当前对应的文件, 文件被替换后重新调用
+void editorWatchFile()
+{
+    if (E.watchfd == -1)
+        return;
+    if (E.watchwd != -1)
+        inotify_rm_watch(E.watchfd, E.watchwd);
+    E.watchwd = inotify_add_watch(E.watchfd, E.filename,
+                                  IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+// 开始监视 E.filename, 打开和另存为时调用, 可以重复调用
+void editorWatchStart()
+{
+    if (!E.watching)
+    {
+        E.watching = 1;
+        E.watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    if (E.watchfd != -1)
+    {
+        char *dir = strdup(E.filename);
+        inotify_add_watch(E.watchfd, dirname(dir), IN_CREATE | IN_MOVED_TO);
+        free(dir);
+    }
+    editorWatchFile();
+}
+
+/*
+--follow 像 tail -F 一样跟随文件: 有变化时只读入上次之后新增的内容, 切分成行追加到行树
+末尾, 行直接指向读入的缓冲区。文件被截断或轮转 (按原名新建) 时已有的行留作历史, 从新
+内容的开头接着读, 不重新载入整个文件。光标在最后一行时随新的行移动。
+*/
+
+// 文件中 end 之前最后一个换行符之后的位置
+long long followLineStart(int fd, long long end)
+{
+    char buf[4096];
+    while (end > 0)
+    {
+        long long from = end > (long long)sizeof(buf) ? end - (long long)sizeof(buf) : 0;
+        ssize_t n = pread(fd, buf, end - from, from);
+        if (n <= 0)
+            break;
+        char *nl = memrchr(buf, '\n', n);
+        if (nl)
+            return from + (nl - buf) + 1;
+        end = from;
+    }
+    return end;
+}
+
+// 载入结束, 之后的内容由跟随读入; 最后一行可能还没写完
+void editorFollowLoaded(long long loaded)
+{
+    viewstate *v = &E.view;
+    v->off = loaded;
+    v->part = followLineStart(v->fd, loaded);
+    v->partbuf = NULL;
+    E.watchpending = 1; // 载入线程读到末尾之后写入的内容
+}
+
+// 读入 [v->part, size) 中新增的内容追加成行, 一次最多 QEDITOR_FOLLOW_READ 字节
+int editorFollowAppend(long long size)
+{
+    viewstate *v = &E.view;
+    long long from = v->part;
+    long long want = size - from < QEDITOR_FOLLOW_READ ? size - from : QEDITOR_FOLLOW_READ;
+    char *buf = malloc(want);
+    long long n = 0;
+    while (n < want)
+    {
+        ssize_t r = pread(v->fd, buf + n, want - n, from + n);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        n += r;
+        // 读满了还没有一个完整的行时, 把这一行剩下的部分也读进来
+        if (n == want && want < size - from && !memchr(buf, '\n', n))
+        {
+            want = size - from;
+            buf = realloc(buf, want);
+        }
+    }
+
+    int eof = from + n >= size;
+    loadchunk *chunk = loadNewChunk(buf, 1);
+    size_t pos = loadScan(chunk, 0, n, INT_MAX, eof);
+    if (from + n <= v->off || chunk->nlines == 0)
+    {
+        // 读的时候文件又被截断了, 留给下一轮处理
+        loadFreeChunk(chunk);
+        return 0;
+    }
+
+    int tail = E.cy + 1 >= E.numrows; // 光标在最后一行时跟随新的行
+    if (v->part < v->off)
+    {
+        // 不完整的最后一行换成重新读入的这一行
+        long long at = E.numrows - 1;
+        if (E.search.job && E.search.job->numrows > at)
+            searchCancel();
+        erow *row = ropeRemove(at);
+        editorFreeRow(row);
+        rowFree(row, sizeof(erow));
+        E.numrows--;
+        editorSyntaxDelRow(at);
+        free(v->partbuf);
+    }
+    int i;
+    for (i = 0; i < chunk->nlines; i++)
+    {
+        ropeInsert(E.numrows, editorNewRow(buf + chunk->off[i], chunk->len[i], 0, ROW_MAPPED));
+        editorSyntaxInsertRow(E.numrows);
+        E.numrows++;
+    }
+
+    v->off = from + pos;
+    v->part = v->off;
+    v->partbuf = NULL;
+    if (pos > 0 && buf[pos - 1] != '\n')
+    {
+        v->part = from + chunk->off[chunk->nlines - 1];
+        if (chunk->nlines == 1)
+            v->partbuf = buf;
+    }
+    chunk->owned = 0; // 新的行指向 buf
+    loadFreeChunk(chunk);
+    if (!eof)
+    {
+        E.watchpending = 1; // 还有没读的内容, 下一轮继续
+        editorWake();
+    }
+    if (tail)
+    {
+        E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+        E.cx = 0;
+    }
+    searchExtend();
+    return 1;
+}
+
+// 文件名现在指向另一个文件 (轮转) 时改为跟随新的文件, 返回 1
+int editorFollowRotate()
+{
+    viewstate *v = &E.view;
+    struct stat cur, st;
+    if (stat(E.filename, &st) == -1 || fstat(v->fd, &cur) == -1)
+        return 0; // 旧的文件被移走, 新的还没有建立
+    if (st.st_ino == cur.st_ino && st.st_dev == cur.st_dev)
+        return 0;
+    int fd = open(E.filename, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    close(v->fd);
+    v->fd = fd;
+    v->off = v->part = 0;
+    v->partbuf = NULL;
+    editorWatchFile();
+    editorSetStatusMessage("%s: file rotated, following the new file", E.filename);
+    return 1;
+}
+
+// 处理文件的变化: 先读完当前文件新增的内容, 再检查截断和轮转
+int editorFollowRead()
+{
+    viewstate *v = &E.view;
+    struct stat st;
+    int changed = 0;
+    int round;
+    for (round = 0; round < 2; round++)
+    {
+        if (fstat(v->fd, &st) == -1)
+            return changed;
+        if (st.st_size < v->off)
+        {
+            v->off = v->part = 0;
+            v->partbuf = NULL;
+            editorSetStatusMessage("%s: file truncated", E.filename);
+            changed = 1;
+        }
+        if (st.st_size > v->off)
+            changed |= editorFollowAppend(st.st_size);
+        if (E.watchpending || !editorFollowRotate())
+            break;
+        changed = 1; // 轮转后接着读新文件已有的内容
+    }
+    return changed;
+}
+
+/*
+没有 --follow 时, 其他程序修改了文件就重新载入, 只替换变化了的行。缓冲区有未保存的修改时
+不载入, 只给出提示, 保存时覆盖磁盘上的内容。比较时先跳过开头和末尾相同的行; 中间部分计算
+每行的哈希, 相同的行逐行前进, 遇到不同时在逐步加倍的窗口中找连续 QEDITOR_RELOAD_SYNC 行
+哈希都相同的位置重新对齐, 跳过的行就是一处变化。新的内容仍要整个扫描一遍, 但删除和插入
+行、渲染、撤销记录都只与变化的行数成正比。这些修改和普通的编辑一样记入撤销日志, 作为
+一组撤销; 光标和滚动位置跟着所在的行移动。映射的文件在原处被改写时, 没修改过的行原来的
+内容已经读不到了, 这时先把行复制出来并解除映射, 撤销日志清空。
+*/
+
+// 磁盘上的文件是否还是上次记下的那个, 内容没有变化
+int reloadSame(struct stat *a, struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// 行的内容是否可以读取: 文件在原处被截短后, 映射区中超出新长度所在页的部分访问时会收到 SIGBUS
+int reloadReadable(erow *row, const char *mapend)
+{
+    return !editorRowMapped(row) || row->chars + row->size <= mapend;
+}
+
+int reloadRowEqual(erow *row, const char *s, long long len)
+{
+    return row->size == len && memcmp(row->chars, s, len) == 0;
+}
+
+// 一行的哈希, 每次取 8 个字节
+unsigned long long reloadHash(const char *s, long long len)
+{
+    unsigned long long h = (unsigned long long)len * 0x9e3779b97f4a7c15ULL;
+    unsigned long long w;
+    long long i;
+    for (i = 0; i + 8 <= len; i += 8)
+    {
+        memcpy(&w, s + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, s + i, len - i);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    return h;
+}
+
+// 从 h 开始连续 QEDITOR_RELOAD_SYNC 行的哈希合成一个
+unsigned long long reloadWindow(const unsigned long long *h)
+{
+    unsigned long long k = h[0];
+    int i;
+    for (i = 1; i < QEDITOR_RELOAD_SYNC; i++)
+        k = k * 0x9e3779b97f4a7c15ULL ^ h[i];
+    return k;
+}
+
+// 从 off 开始读满 len 字节; 读不满说明文件在读的时候变短了, 返回 -1
+int preadAll(int fd, char *buf, long long len, long long off)
+{
+    long long n = 0;
+    while (n < len)
+    {
+        ssize_t k = pread(fd, buf + n, len - n, off + n);
+        if (k == -1 && errno == EINTR)
+            continue;
+        if (k <= 0)
+            return -1;
+        n += k;
+    }
+    return 0;
+}
+
+// 把文件中从 at 开始 (backward 为 1 时是在 at 结束) 的一块读入 r->buf, 不超出 [from, r->size)
+int readerFill(reloadreader *r, long long from, long long at, int backward)
+{
+    long long cap = r->cap;
+    long long lo = backward ? (at - from > cap ? at - cap : from) : at;
+    long long hi = backward ? at : (r->size - at > cap ? at + cap : r->size);
+    if (preadAll(r->fd, r->buf, hi - lo, lo) == -1)
+        return -1;
+    r->lo = lo;
+    r->hi = hi;
+    return 0;
+}
+
+// 一行比整块还长, 加大缓冲区
+void readerGrow(reloadreader *r)
+{
+    r->cap *= 2;
+    r->buf = realloc(r->buf, r->cap);
+}
+
+// 取出新内容中从 pos 开始的一行, *len 与 loadScan 一样去掉换行符和行末的 \r,
+// *next 是下一行的开头; 读取失败时返回 NULL
+const char *readerNext(reloadreader *r, long long pos, long long *len, long long *next)
+{
+    for (;;)
+    {
+        if (pos >= r->lo && pos < r->hi)
+        {
+            const char *line = r->buf + (pos - r->lo);
+            const char *nl = memchr(line, '\n', r->hi - pos);
+            if (nl || r->hi == r->size)
+            {
+                long long e = nl ? nl - line : r->hi - pos;
+                *next = pos + e + (nl ? 1 : 0);
+                while (e > 0 && line[e - 1] == '\r')
+                    e--;
+                *len = e;
+                return line;
+            }
+            if (pos == r->lo)
+                readerGrow(r);
+        }
+        if (readerFill(r, 0, pos, 0) == -1)
+            return NULL;
+    }
+}
+
+// 取出新内容中在 end (下一行的开头或文件末尾) 之前的一行, 不越过 from; *start 是这一行的开头
+const char *readerPrev(reloadreader *r, long long from, long long end, long long *len, long long *start)
+{
+    for (;;)
+    {
+        if (end > r->lo && end <= r->hi)
+        {
+            long long lo = r->lo > from ? r->lo : from;
+            long long e = end;
+            if (r->buf[e - 1 - r->lo] == '\n')
+                e--;
+            const char *nl = memrchr(r->buf + (lo - r->lo), '\n', e - lo);
+            if (nl || lo == from)
+            {
+                long long s = nl ? r->lo + (nl - r->buf) + 1 : from;
+                const char *line = r->buf + (s - r->lo);
+                while (e > s && line[e - s - 1] == '\r')
+                    e--;
+                *len = e - s;
+                *start = s;
+                return line;
+            }
+            if (end == r->hi)
+                readerGrow(r);
+        }
+        if (readerFill(r, from, end, 1) == -1)
+            return NULL;
+    }
+}
+
+// 跳过开头和末尾相同的行, 之后第 [*p, *oe) 行对应新内容中的 [*pos, *end); 读取失败时返回 -1
+int reloadSkipSame(reloadreader *r, long long *p, long long *oe,
+                   long long *pos, long long *end)
+{
+    rowiter it;
+    const char *line;
+    long long len, at;
+    *p = *pos = 0;
+    erow *row = editorRowIterStart(&it, 0);
+    while (row && *pos < r->size)
+    {
+        if (!(line = readerNext(r, *pos, &len, &at)))
+            return -1;
+        if (!reloadRowEqual(row, line, len))
+            break;
+        (*p)++;
+        *pos = at;
+        row = editorRowIterNext(&it);
+    }
+    *oe = E.numrows;
+    *end = r->size;
+    row = editorRowIterStart(&it, *oe - 1);
+    while (*oe > *p && *end > *pos)
+    {
+        if (!(line = readerPrev(r, *pos, *end, &len, &at)))
+            return -1;
+        if (!reloadRowEqual(row, line, len))
+            break;
+        (*oe)--;
+        *end = at;
+        row = editorRowIterPrev(&it);
+    }
+    return 0;
+}
+
+// 在旧的 no 行和新的 nn 行中找重新对齐的位置: 从 ho[*a] 和 hn[*b] 开始连续
+// QEDITOR_RELOAD_SYNC 行的哈希相同, 且 *a + *b 最小; 找不到时剩下的全部算作变化
+void reloadSync(const unsigned long long *ho, long long no,
+                const unsigned long long *hn, long long nn, long long *a, long long *b)
+{
+    *a = no;
+    *b = nn;
+    long long lasta = no - QEDITOR_RELOAD_SYNC + 1, lastb = nn - QEDITOR_RELOAD_SYNC + 1;
+    if (lasta <= 0 || lastb <= 0)
+        return;
+    long long w;
+    for (w = 64;; w *= 2)
+    {
+        long long wa = w < lasta ? w : lasta;
+        long long wb = w < lastb ? w : lastb;
+        // 旧的窗口中每种哈希第一次出现的位置
+        size_t cap = 1;
+        while (cap < (size_t)wa * 2)
+            cap *= 2;
+        unsigned long long *keys = malloc(sizeof(unsigned long long) * cap);
+        long long *at = malloc(sizeof(long long) * cap);
+        size_t slot;
+        long long x, y;
+        for (slot = 0; slot < cap; slot++)
+            at[slot] = -1;
+        for (x = 0; x < wa; x++)
+        {
+            unsigned long long k = reloadWindow(ho + x);
+            for (slot = k & (cap - 1); at[slot] != -1 && keys[slot] != k; slot = (slot + 1) & (cap - 1))
+                ;
+            if (at[slot] == -1)
+            {
+                keys[slot] = k;
+                at[slot] = x;
+            }
+        }
+        long long best = -1;
+        for (y = 0; y < wb && (best == -1 || y < best); y++)
+        {
+            unsigned long long k = reloadWindow(hn + y);
+            for (slot = k & (cap - 1); at[slot] != -1 && keys[slot] != k; slot = (slot + 1) & (cap - 1))
+                ;
+            x = at[slot];
+            if (x == -1 || (best != -1 && x + y >= best) ||
+                memcmp(ho + x, hn + y, sizeof(unsigned long long) * QEDITOR_RELOAD_SYNC) != 0)
+                continue;
+            best = x + y;
+            *a = x;
+            *b = y;
+        }
+        free(keys);
+        free(at);
+        if (best != -1 || (wa == lasta && wb == lastb))
+            return;
+    }
+}
+
+void reloadAddOp(reloadop **ops, int *nops, int *cap, long long at, long long del, long long from, long long ins)
+{
+    if (*nops == *cap)
+    {
+        *cap = *cap ? *cap * 2 : 16;
+        *ops = realloc(*ops, sizeof(reloadop) * *cap);
+    }
+    reloadop *op = &(*ops)[(*nops)++];
+    op->at = at;
+    op->del = del;
+    op->from = from;
+    op->ins = ins;
+}
+
+// 比较行树中 [p, p + no) 行和 chunk 中的新行, 把变化按顺序记入 ops
+void reloadDiff(long long p, long long no, loadchunk *chunk,
+                reloadop **ops, int *nops, int *cap)
+{
+    long long nn = chunk->nlines;
+    unsigned long long *ho = malloc(sizeof(unsigned long long) * (no + 1));
+    unsigned long long *hn = malloc(sizeof(unsigned long long) * (nn + 1));
+    rowiter it;
+    erow *row = editorRowIterStart(&it, p);
+    long long i, j;
+    for (i = 0; i < no; i++, row = editorRowIterNext(&it))
+        ho[i] = reloadHash(row->chars, row->size);
+    for (j = 0; j < nn; j++)
+        hn[j] = reloadHash(chunk->base + chunk->off[j], chunk->len[j]);
+
+    i = j = 0;
+    row = editorRowIterStart(&it, p);
+    while (i < no && j < nn)
+    {
+        if (ho[i] == hn[j] && reloadRowEqual(row, chunk->base + chunk->off[j], chunk->len[j]))
+        {
+            i++;
+            j++;
+            row = editorRowIterNext(&it);
+            continue;
+        }
+        long long a, b;
+        reloadSync(ho + i, no - i, hn + j, nn - j, &a, &b);
+        if (a == 0 && b == 0)
+            a = b = 1; // 哈希相同而内容不同, 只把这一行算作变化
+        reloadAddOp(ops, nops, cap, p + i, a, j, b);
+        i += a;
+        j += b;
+        row = editorRowIterStart(&it, p + i);
+    }
+    if (i < no || j < nn)
+        reloadAddOp(ops, nops, cap, p + i, no - i, j, nn - j);
+    free(ho);
+    free(hn);
+}
+
+// 映射区中还能读取的部分的末尾: 文件在原处被截短时, 超出新长度所在页的部分不能再读
+const char *reloadMapEnd(struct stat *st)
+{
+    if (!E.map)
+        return NULL;
+    if (st->st_dev == E.mapdev && st->st_ino == E.mapino)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t valid = (st->st_size + page - 1) / page * page;
+        if (valid < E.mapsize)
+            return E.map + valid;
+    }
+    return E.map + E.mapsize;
+}
+
+// 映射的文件在原处被改写时, 把还指向映射区的行都复制出来并解除映射,
+// 之后显示和保存都不再读取这个文件。超出新长度的行已经读不到了, 变成空行, 撤销日志也作废;
+// 返回这样的行数
+long long reloadDetach(const char *mapend)
+{
+    rowiter it;
+    erow *row;
+    long long lost = 0;
+    for (row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it))
+    {
+        if (!editorRowMapped(row))
+            continue;
+        if (!reloadReadable(row, mapend))
+        {
+            ropeRowResized(row, -row->size);
+            editorColCacheInvalidate(row, 0);
+            row->size = 0;
+            lost++;
+        }
+        editorRowOwn(row);
+        editorUpdateRow(row);
+    }
+    munmap(E.map, E.mapsize);
+    E.map = NULL;
+    E.mapsize = 0;
+    if (lost)
+        editorUndoReset();
+    return lost;
+}
+
+// 第 y 行在一处变化之后的行号: 之后的行跟着移动, 被替换的行对应到新内容中相同的位置
+long long reloadMapRow(long long y, reloadop *op)
+{
+    if (y >= op->at + op->del)
+        return y + op->ins - op->del;
+    if (y < op->at)
+        return y;
+    long long k = y - op->at;
+    if (k >= op->ins)
+        k = op->ins > 0 ? op->ins - 1 : 0;
+    return op->at + k;
+}
+
+// 磁盘上的文件变了时重新载入变化的部分, 有变化时返回 1
+int editorReload()
+{
+    struct stat st;
+    if (stat(E.filename, &st) == -1 || reloadSame(&st, &E.disk))
+        return 0; // 文件被移走或删除时保留缓冲区
+    if (E.dirty)
+    {
+        E.disk = st;
+        if (!E.map || st.st_dev != E.mapdev || st.st_ino != E.mapino)
+            editorSetStatusMessage("File changed on disk! Unsaved changes kept, Ctrl-S overwrites it");
+        else
+        {
+            // 没修改过的行指向的映射区已经变了, 不能再说保留了原来的内容
+            long long lost = reloadDetach(reloadMapEnd(&st));
+            if (lost)
+                editorSetStatusMessage("File truncated on disk! %lld unedited lines lost, Ctrl-S overwrites it", lost);
+            else
+                editorSetStatusMessage("File rewritten in place! Unedited lines may differ, Ctrl-S overwrites it");
+        }
+        return 1;
+    }
+    int fd = open(E.filename, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return 0;
+    }
+    long long start = editorNowNs();
+
+    // 文件在原处被改写时, 映射区中的行读到的已经是新文件在原来位置上的字节, 原来的内容
+    // 找不回来了: 先把这些行复制出来并解除映射, 这一次的修改也不能记入撤销日志
+    int inplace = E.map && st.st_dev == E.mapdev && st.st_ino == E.mapino;
+    if (inplace)
+        reloadDetach(reloadMapEnd(&st));
+    editorCloseGap();
+
+    // 新的内容用 pread 读取, 读的时候文件被截短也不会像映射区那样收到 SIGBUS;
+    // 只有中间变化的部分整个读入, 新的行从这里复制
+    reloadreader r = {fd, malloc(QEDITOR_LOAD_BLOCK), QEDITOR_LOAD_BLOCK, 0, 0, st.st_size};
+    long long p, oe, pos, end;
+    int ok = reloadSkipSame(&r, &p, &oe, &pos, &end) == 0;
+    free(r.buf);
+    char *mid = ok ? malloc(end - pos + 1) : NULL;
+    if (ok && preadAll(fd, mid, end - pos, pos) == -1)
+        ok = 0;
+    close(fd);
+    if (!ok)
+    {
+        // 文件正在被改写, 等下一个事件再载入
+        free(mid);
+        return 0;
+    }
+
+    loadchunk *chunk = loadNewChunk(mid, 1);
+    loadScan(chunk, 0, end - pos, INT_MAX, 1);
+    reloadop *ops = NULL;
+    int nops = 0, opcap = 0;
+    if (oe > p && chunk->nlines > 0)
+        reloadDiff(p, oe - p, chunk, &ops, &nops, &opcap);
+    else if (oe > p || chunk->nlines > 0)
+        reloadAddOp(&ops, &nops, &opcap, p, oe - p, 0, chunk->nlines);
+
+    // 改动的文本超过撤销日志的上限, 或者文件是在原处被改写的, 不记录, 之前的记录也作废
+    long long bytes = 0, del = 0, ins = 0;
+    rowiter it;
+    erow *row;
+    int k;
+    long long t;
+    for (k = 0; k < nops; k++)
+    {
+        row = editorRowIterStart(&it, ops[k].at);
+        for (t = 0; t < ops[k].del; t++, row = editorRowIterNext(&it))
+            bytes += row->size;
+        for (t = 0; t < ops[k].ins; t++)
+            bytes += chunk->len[ops[k].from + t];
+        del += ops[k].del;
+        ins += ops[k].ins;
+    }
+    if (nops == 0)
+    {
+        // 只是时间戳变了
+        loadFreeChunk(chunk);
+        E.disk = st;
+        return 0;
+    }
+    int record = !inplace && (size_t)bytes <= E.undo.limit;
+    if (!record)
+        E.undo.suspend++;
+    if (E.search.job)
+        searchCancel(); // 查找结果中的行号已经不对了
+
+    // 从后往前修改, 前面的变化的行号不受影响
+    editorUndoBegin();
+    long long cy = E.cy, rowoff = E.rowoff;
+    int inside = E.cy < E.numrows, empty = E.numrows == 0;
+    for (k = nops - 1; k >= 0; k--)
+    {
+        reloadop *op = &ops[k];
+        for (t = 0; t < op->del; t++)
+            editorDelRow(op->at);
+        for (t = 0; t < op->ins; t++)
+            editorInsertRow(op->at + t, mid + chunk->off[op->from + t], chunk->len[op->from + t]);
+        cy = reloadMapRow(cy, op);
+        rowoff = reloadMapRow(rowoff, op);
+    }
+    // 光标所在的行被删掉时停在附近的行上; 原来是空缓冲区时停在开头; 屏幕尽量保持填满
+    E.cy = empty ? 0 : cy < E.numrows ? cy : E.numrows;
+    if (inside && E.cy == E.numrows && E.numrows > 0)
+        E.cy--;
+    E.rowoff = rowoff;
+    if (E.rowoff > E.cy || (E.rowoff >= E.numrows && E.numrows > 0))
+        E.rowoff = E.cy >= E.screenrows ? E.cy - E.screenrows + 1 : 0;
+    row = editorRow(E.cy);
+    long long rowlen = row ? row->size : 0;
+    if (E.cx > rowlen)
+        E.cx = rowlen;
+    if (E.cx < rowlen)
+        E.cx = editorRowCharStart(row, E.cx);
+    editorUndoEnd();
+    if (!record)
+    {
+        E.undo.suspend--;
+        editorUndoReset();
+    }
+
+    loadFreeChunk(chunk);
+    free(ops);
+    E.dirty = 0;
+    E.disk = st;
+    editorWatchFile();
+    editorSetStatusMessage("Reloaded from disk: %lld lines replaced by %lld (%.1f ms)%s", del, ins,
+                           (editorNowNs() - start) / 1e6, record ? "" : ", undo cleared");
+    return 1;
+}
+
+// 主循环空闲时处理打开的文件的变化, 有新的行或状态变化时返回 1
+int editorWatchPoll()
+{
+    if (!E.watching)
+        return 0;
+    if (E.watchfd != -1)
+    {
+        char buf[4096];
+        while (read(E.watchfd, buf, sizeof(buf)) > 0)
+            E.watchpending = 1;
+    }
+    else if (!E.timers[TIMER_WATCH])
+    {
+        E.watchpending = 1;
+        editorSetTimer(TIMER_WATCH, QEDITOR_WATCH_POLL);
+    }
+    // 载入或保存还没结束时先不处理; 查找线程在读行树时不能修改
+    if (!E.watchpending || editorLoading() || E.save || !searchIdle())
+        return 0;
+    E.watchpending = 0;
+    return E.view.follow ? editorFollowRead() : editorReload();
+}
+
+// 把 iov 中的 n 个片段全部写入 fd, 处理只写了一部分的情况; iov 会被修改
+int writevAll(int fd, struct iovec *iov, int n, long long *written)
+{
+    while (n > 0)
+    {
+        ssize_t w = writev(fd, iov, n);
+        if (w == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        __atomic_add_fetch(written, w, __ATOMIC_RELAXED);
+        // 跳过已经写完的片段
+        while (n > 0 && (size_t)w >= iov->iov_len)
+        {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+// 向快照追加一个片段, 与上一个片段在内存中相邻时直接合并
+void savePiece(savejob *job, const char *p, size_t len)
+{
+    if (len == 0)
+        return;
+    job->total += len;
+    if (job->npieces > 0)
+    {
+        struct iovec *last = &job->pieces[job->npieces - 1];
+        if ((const char *)last->iov_base + last->iov_len == p)
+        {
+            last->iov_len += len;
+            return;
+        }
+    }
+    if (job->npieces == job->cap)
+    {
+        job->cap = job->cap ? job->cap * 2 : 256;
+        job->pieces = realloc(job->pieces, sizeof(struct iovec) * job->cap);
+    }
+    job->pieces[job->npieces].iov_base = (void *)p;
+    job->pieces[job->npieces].iov_len = len;
+    job->npieces++;
+}
+
+// 快照引用的行缓冲区被替换或删除时, 推迟到保存结束再释放
+void saveDefer(savejob *job, char *chars, long long cap)
+{
+    if (job->ngarbage == job->garbagecap)
+    {
+        job->garbagecap = job->garbagecap ? job->garbagecap * 2 : 64;
+        job->garbage = realloc(job->garbage, sizeof(struct iovec) * job->garbagecap);
+    }
+    job->garbage[job->ngarbage].iov_base = chars;
+    job->garbage[job->ngarbage].iov_len = cap;
+    job->ngarbage++;
+}
+
+// 记录所有行当前的内容; 只复制指针, 之后被修改的行由 editorRowOwn 另行复制
+void saveSnapshot(savejob *job)
+{
+    rowiter it;
+    erow *row;
+    for (row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it))
+    {
+        // 映射区中的行后面紧跟着换行符, 连同换行符一起记录, 相邻的行会合并成一个片段
+        if (editorRowMapped(row) && row->chars + row->size < E.map + E.mapsize &&
+            row->chars[row->size] == '\n')
+        {
+            savePiece(job, row->chars, row->size + 1);
+        }
+        else
+        {
+            savePiece(job, row->chars, row->size);
+            savePiece(job, "\n", 1);
+        }
+    }
+}
+
+// 把快照写入 fd, 每次 writev 最多提交 QEDITOR_SAVE_IOV 个片段
+int saveWriteSnapshot(savejob *job, int fd)
+{
+    struct iovec iov[QEDITOR_SAVE_IOV];
+    int percent = 0;
+    int i;
+    for (i = 0; i < job->npieces; i += QEDITOR_SAVE_IOV)
+    {
+        int n = job->npieces - i < QEDITOR_SAVE_IOV ? job->npieces - i : QEDITOR_SAVE_IOV;
+        memcpy(iov, &job->pieces[i], sizeof(struct iovec) * n);
+        if (writevAll(fd, iov, n, &job->written) == -1)
+            return -1;
+        // 进度变化时唤醒主循环刷新状态栏
+        if (job->written * 100 / job->total != percent)
+        {
+            percent = (int)(job->written * 100 / job->total);
+            editorWake();
+        }
+    }
+    return 0;
+}
+
+// 把快照写入同一目录下的临时文件, 同步到磁盘后用 rename 原子地替换目标文件
+int editorWriteFile(savejob *job)
+{
+    // 目标是符号链接时替换它指向的文件
+    char *path = realpath(job->filename, NULL);
+    if (!path)
+        path = strdup(job->filename);
+    size_t tmplen = strlen(path) + 16;
+    char *tmp = malloc(tmplen);
+    snprintf(tmp, tmplen, "%s.qe-XXXXXX", path);
+
+    int fd = mkstemp(tmp);
+    int ok = fd != -1;
+    if (ok)
+    {
+        // 保留原文件的权限和属主, 新文件与直接 open 创建时的权限相同
+        struct stat st;
+        if (stat(path, &st) == 0)
+        {
+            fchmod(fd, st.st_mode & 07777);
+            if (fchown(fd, st.st_uid, st.st_gid) == -1)
+                errno = 0; // 没有权限修改属主时保持当前用户
+        }
+        else
+        {
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0664 & ~mask);
+        }
+        ok = saveWriteSnapshot(job, fd) == 0 && fsync(fd) == 0;
+        ok = close(fd) == 0 && ok;
+        ok = ok && rename(tmp, path) == 0;
+    }
+
+    int saved = errno;
+    if (fd != -1 && !ok)
+        unlink(tmp);
+    if (ok)
+    {
+        // 同步目录, 保证 rename 本身也已落盘
+        char *slash = strrchr(path, '/');
+        if (slash)
+            *slash = '\0';
+        int dfd = open(slash ? (*path ? path : "/") : ".", O_RDONLY);
+        if (dfd != -1)
+        {
+            fsync(dfd);
+            close(dfd);
+        }
+    }
+    free(tmp);
+    free(path);
+    errno = saved;
+    return ok ? 0 : -1;
+}
+
+// 保存线程, 只读取快照, 不访问编辑器的其他状态
+void *saveWorker(void *arg)
+{
+    savejob *job = arg;
+    job->err = editorWriteFile(job) == -1 ? errno : 0;
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    editorWake();
+    return NULL;
+}
+
+// 保存线程结束后回收快照, 报告结果; 快照之后没有新的修改时才清除修改标记
+void editorSaveFinish()
+{
+    savejob *job = E.save;
+    pthread_join(job->thread, NULL);
+    E.save = NULL;
+
+    if (job->err)
+    {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+    }
+    else
+    {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = (end.tv_sec - job->start.tv_sec) + (end.tv_nsec - job->start.tv_nsec) / 1e9;
+        if (E.dirty == job->dirty)
+            E.dirty = 0;
+        // 保存换掉了磁盘上的文件, 记下新的文件, 自己写入的变化不会触发重新载入
+        stat(E.filename, &E.disk);
+        editorWatchStart();
+        E.prof.savebytes += job->total;
+        E.prof.savens += secs * 1e9;
+        editorSetStatusMessage("%lld bytes written to disk (%.1f MB/s)", job->total,
+                               secs > 0 ? job->total / secs / (1024 * 1024) : 0.0);
+    }
+
+    int i;
+    for (i = 0; i < job->ngarbage; i++)
+        rowFree(job->garbage[i].iov_base, job->garbage[i].iov_len);
+    free(job->garbage);
+    free(job->pieces);
+    free(job->filename);
+    free(job);
+}
+
+// 已写出的百分比
+int editorSavePercent()
+{
+    savejob *job = E.save;
+    long long written = __atomic_load_n(&job->written, __ATOMIC_RELAXED);
+    return job->total ? (int)(written * 100 / job->total) : 100;
+}
+
+// 保存完成时回收; 进度变化时返回 1, 让调用者刷新状态栏
+int editorSavePoll()
+{
+    savejob *job = E.save;
+    if (!job)
+        return 0;
+    if (__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+    {
+        editorSaveFinish();
+        return 1;
+    }
+    int percent = editorSavePercent();
+    if (percent == job->percent)
+        return 0;
+    job->percent = percent;
+    return 1;
+}
+
+// 等待正在进行的保存结束, 退出前调用
+void editorSaveWait()
+{
+    if (E.save)
+        editorSaveFinish();
+}
+
+// 在后台保存: 主线程只记录快照, 写文件和同步由保存线程完成, 编辑不受影响
+void editorSave(){
+    if(E.save){
+        editorSetStatusMessage("Save already in progress (%d%%)", editorSavePercent());
+        return;
+    }
+    if(E.filename == NULL) {
         E.filename = editorPrompt("Save as: %s (ESC to cancel)",NULL);
         if(E.filename == NULL){
             editorSetStatusMessage("Save aborted");
             return;
         }
+        editorSelectSyntaxHighlight();
     }
 
-    int len;
-    char* buf=editorRowsToString(&len);
-    int fd = open(E.filename, O_RDWR|O_CREAT, 0664);
-    if(fd!=-1){
-        if(ftruncate(fd, len) != -1){
-            if(write(fd, buf, len) == len){
-                close(fd);
-                free(buf);
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
+    editorLoadAll();
+    editorCloseGap();
+
+    savejob *job = calloc(1, sizeof(savejob));
+    job->filename = strdup(E.filename);
+    job->dirty = E.dirty;
+    job->gen = E.gen++;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    saveSnapshot(job);
+
+    if(pthread_create(&job->thread, NULL, saveWorker, job) != 0){
+        editorSetStatusMessage("Can't save! %s", strerror(errno));
+        free(job->pieces);
+        free(job->filename);
+        free(job);
+        return;
+    }
+    E.save = job;
+    editorSetStatusMessage("Saving...");
+}
+
+
+/******************** search kernel ********************/
+/*
+子串查找: 先用 SIMD 同时比较候选位置的首字节和尾字节, 两者都匹配的位置再逐字节比较。
+启动时根据 CPU 选择 AVX2 / SSE2 实现, 其他平台使用标量实现。
+*/
+
+const char *searchScalar(const char *hay, size_t n, const char *needle, size_t m)
+{
+    if (m == 0)
+        return hay;
+    const char *end = hay + n;
+    while (n >= m)
+    {
+        const char *p = memchr(hay, needle[0], n - m + 1);
+        if (!p)
+            return NULL;
+        if (memcmp(p + 1, needle + 1, m - 1) == 0)
+            return p;
+        hay = p + 1;
+        n = end - hay;
+    }
+    return NULL;
+}
+
+#ifdef QEDITOR_X86
+__attribute__((target("sse2")))
+const char *searchSSE2(const char *hay, size_t n, const char *needle, size_t m)
+{
+    if (m < 2 || n < m)
+        return searchScalar(hay, n, needle, m);
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i;
+    for (i = 0; i + m - 1 + 16 <= n; i += 16)
+    {
+        __m128i bf = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i bl = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, bf),
+                                                        _mm_cmpeq_epi8(last, bl)));
+        while (mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0)
+                return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return searchScalar(hay + i, n - i, needle, m);
+}
+
+__attribute__((target("avx2")))
+const char *searchAVX2(const char *hay, size_t n, const char *needle, size_t m)
+{
+    if (m < 2 || n < m)
+        return searchScalar(hay, n, needle, m);
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    size_t i;
+    for (i = 0; i + m - 1 + 32 <= n; i += 32)
+    {
+        __m256i bf = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i bl = _mm256_loadu_si256((const __m256i *)(hay + i + m - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, bf),
+                                                              _mm256_cmpeq_epi8(last, bl)));
+        while (mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0)
+                return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return searchSSE2(hay + i, n - i, needle, m);
+}
+#endif
+
+void editorInitSearch()
+{
+    E.memsearch = searchScalar;
+#ifdef QEDITOR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        E.memsearch = searchAVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        E.memsearch = searchSSE2;
+#endif
+}
+
+/*
+映射区中没有修改过的相邻行在内存中只隔着换行符, 可以合并成一段一起扫描。
+it 指向一段的第一行, 返回合并的行数 (不超过 limit), *end 为这段内容的结尾,
+返回后 it 指向下一段的第一行。
+*/
+int editorSearchRun(rowiter *it, long long limit, const char **end)
+{
+    erow *row = it->blk->rows[it->idx];
+    erow *next;
+    int n = 1;
+    *end = row->chars + row->size;
+    while ((next = editorRowIterNext(it)) != NULL && n < limit &&
+           editorRowMapped(row) && editorRowMapped(next) &&
+           next->chars >= *end && next->chars - *end <= 2)
+    {
+        *end = next->chars + next->size;
+        n++;
+    }
+    return n;
+}
+
+/******************** search workers ********************/
+/*
+查找在后台线程中进行: 所有行按块分给工作线程, 每块记录其中全部匹配的位置,
+主线程按块的顺序把它们组成匹配索引。查询改变时取消旧任务, 重新开始。
+*/
+
+void searchChunkAdd(searchchunk *chunk, long long row, long long col)
+{
+    if (chunk->nmatches == chunk->cap)
+    {
+        chunk->cap = chunk->cap ? chunk->cap * 2 : 16;
+        chunk->matches = realloc(chunk->matches, sizeof(searchmatch) * chunk->cap);
+    }
+    chunk->matches[chunk->nmatches].row = row;
+    chunk->matches[chunk->nmatches].col = col;
+    chunk->nmatches++;
+}
+
+// 找出第 c 块中的全部匹配 (互不重叠)
+void searchChunkRun(searchjob *job, int c)
+{
+    searchchunk *chunk = &job->chunks[c];
+    long long at = chunk->from;
+    long long to = chunk->to;
+    rowiter it;
+    editorRowIterStart(&it, at);
+    while (at < to && it.blk)
+    {
+        if (__atomic_load_n(&job->cancel, __ATOMIC_RELAXED))
+            return;
+        rowiter walk = it;
+        erow *r = it.blk->rows[it.idx];
+        long long ridx = at;
+        const char *end;
+        int n = editorSearchRun(&it, to - at, &end);
+
+        const char *p = r->chars;
+        const char *match;
+        while ((match = E.memsearch(p, end - p, job->query, job->qlen)) != NULL)
+        {
+            // 查询中不含换行符, 匹配一定落在某一行之内, 找出是哪一行
+            while (ridx < at + n - 1)
+            {
+                rowiter peek = walk;
+                erow *nr = editorRowIterNext(&peek);
+                if (nr->chars > match)
+                    break;
+                walk = peek;
+                r = nr;
+                ridx++;
             }
+            searchChunkAdd(chunk, ridx, match - r->chars);
+            p = match + job->qlen;
         }
-        close(fd);
+        at += n;
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
+void *searchWorker(void *arg)
+{
+    searchpool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        searchjob *job = pool->job;
+        if (!job || __atomic_load_n(&job->cancel, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&job->nextchunk, __ATOMIC_RELAXED) >= job->nchunks)
+        {
+            pthread_cond_wait(&pool->work, &pool->lock);
+            continue;
+        }
+        pool->busy++;
+        pthread_mutex_unlock(&pool->lock);
+
+        int c;
+        while ((c = __atomic_fetch_add(&job->nextchunk, 1, __ATOMIC_RELAXED)) < job->nchunks)
+        {
+            searchChunkRun(job, c);
+            if (__atomic_load_n(&job->cancel, __ATOMIC_RELAXED))
+                break;
+            __atomic_store_n(&job->chunks[c].done, 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&job->news, 1, __ATOMIC_RELAXED);
+            editorWake();
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_broadcast(&pool->progress);
+            pthread_mutex_unlock(&pool->lock);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+        {
+            pthread_cond_broadcast(&pool->idle);
+            editorWake(); // 主循环可能在等工作线程空闲后载入新的行
+        }
+    }
+    return NULL;
+}
+
+void searchPoolStart()
+{
+    searchpool *pool = &E.search;
+    if (pool->nthreads)
+        return;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pthread_cond_init(&pool->progress, NULL);
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = ncpu < 1 ? 1 : ncpu > QEDITOR_SEARCH_THREADS ? QEDITOR_SEARCH_THREADS : (int)ncpu;
+    for (pool->nthreads = 0; pool->nthreads < n; pool->nthreads++)
+    {
+        if (pthread_create(&pool->threads[pool->nthreads], NULL, searchWorker, pool) != 0)
+            die("pthread_create");
+    }
+}
+
+// 取消当前任务并等待所有工作线程离开它, 然后释放
+void searchCancel()
+{
+    searchpool *pool = &E.search;
+    if (!pool->job)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    searchjob *job = pool->job;
+    __atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+    while (pool->busy > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pool->job = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    int c;
+    for (c = 0; c < job->nchunks; c++)
+        free(job->chunks[c].matches);
+    free(job->chunks);
+    free(job->query);
+    free(job);
+}
+
+// 把 job->numrows 之后的行分块加入任务
+void searchAddChunks(searchjob *job)
+{
+    int n = (int)((E.numrows - job->numrows + QEDITOR_SEARCH_CHUNK - 1) / QEDITOR_SEARCH_CHUNK);
+    if (n <= 0)
+        return;
+    job->chunks = realloc(job->chunks, sizeof(searchchunk) * (job->nchunks + n));
+    int c;
+    for (c = job->nchunks; c < job->nchunks + n; c++)
+    {
+        searchchunk *chunk = &job->chunks[c];
+        chunk->matches = NULL;
+        chunk->nmatches = 0;
+        chunk->cap = 0;
+        chunk->done = 0;
+        chunk->from = job->numrows;
+        chunk->to = chunk->from + QEDITOR_SEARCH_CHUNK < E.numrows ? chunk->from + QEDITOR_SEARCH_CHUNK : E.numrows;
+        job->numrows = chunk->to;
+    }
+    job->nchunks += n;
+}
+
+void searchStart(const char *query)
+{
+    searchCancel();
+    searchPoolStart();
+
+    searchjob *job = malloc(sizeof(searchjob));
+    job->query = strdup(query);
+    job->qlen = strlen(query);
+    job->numrows = 0;
+    job->nchunks = 0;
+    job->nextchunk = 0;
+    job->cancel = 0;
+    job->news = 0;
+    job->chunks = NULL;
+    searchAddChunks(job);
+
+    pthread_mutex_lock(&E.search.lock);
+    E.search.job = job;
+    pthread_cond_broadcast(&E.search.work);
+    pthread_mutex_unlock(&E.search.lock);
+}
+
+// 工作线程是否都没有在读行树: 没有任务, 或者任务中的块都已完成
+int searchIdle()
+{
+    searchpool *pool = &E.search;
+    searchjob *job = pool->job;
+    if (!job)
+        return 1;
+    pthread_mutex_lock(&pool->lock);
+    int idle = pool->busy == 0 && __atomic_load_n(&job->nextchunk, __ATOMIC_RELAXED) >= job->nchunks;
+    pthread_mutex_unlock(&pool->lock);
+    return idle;
+}
+
+// 等待任务中的块全部完成, 之后才能修改行树
+void searchWaitIdle()
+{
+    searchpool *pool = &E.search;
+    searchjob *job = pool->job;
+    if (!job)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0 || __atomic_load_n(&job->nextchunk, __ATOMIC_RELAXED) < job->nchunks)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// 载入了新的行后把它们加入正在进行的查找, 调用时工作线程必须空闲
+void searchExtend()
+{
+    searchpool *pool = &E.search;
+    searchjob *job = pool->job;
+    if (!job || job->numrows >= E.numrows)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    int first = job->nchunks;
+    searchAddChunks(job);
+    __atomic_store_n(&job->nextchunk, first, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int searchChunkDone(searchjob *job, int c)
+{
+    return __atomic_load_n(&job->chunks[c].done, __ATOMIC_ACQUIRE);
+}
+
+// 等待第 c 块完成
+void searchWaitChunk(searchjob *job, int c)
+{
+    if (searchChunkDone(job, c))
+        return;
+    pthread_mutex_lock(&E.search.lock);
+    while (!searchChunkDone(job, c))
+        pthread_cond_wait(&E.search.progress, &E.search.lock);
+    pthread_mutex_unlock(&E.search.lock);
+}
+
+// 从第 c 块开始沿 dir 方向找到第一个有匹配的块, 需要时等待该块完成, 没有匹配返回 -1。
+// 向后越过已载入的部分时只等待下一批行; 向前绕到末尾时要等全部的行载入
+int searchNextChunk(searchjob *job, int c, int dir)
+{
+    int i;
+    for (i = 0; i < job->nchunks; i++, c += dir)
+    {
+        while (c >= job->nchunks && editorLoading())
+            editorLoadRows(E.numrows);
+        if (c < 0)
+        {
+            editorLoadAll();
+            c = job->nchunks - 1;
+        }
+        else if (c >= job->nchunks)
+            c = 0;
+        searchWaitChunk(job, c);
+        if (job->chunks[c].nmatches > 0)
+            return c;
+    }
+    return -1;
+}
+
+// 统计已完成的块中的匹配数, *complete 表示是否全部的行都已载入并且所有块都已完成
+long long searchCount(searchjob *job, int *complete)
+{
+    long long total = 0;
+    int c;
+    *complete = !editorLoading();
+    for (c = 0; c < job->nchunks; c++)
+    {
+        if (searchChunkDone(job, c))
+            total += job->chunks[c].nmatches;
+        else
+            *complete = 0;
+    }
+    return total;
+}
+
+// 后台任务是否有新的结果需要显示
+int editorPollTasks()
+{
+    searchjob *job = E.search.job;
+    int news = job && __atomic_exchange_n(&job->news, 0, __ATOMIC_RELAXED);
+    int loaded = editorLoadPoll();
+    int watched = editorWatchPoll();
+    return editorSavePoll() || news || loaded || watched;
+}
 
 /******************** find ********************/
 void editorFindCallback(char* query, int key){
-    static int last_match = -1;
-    static int direction = 1;
-    
+    // 当前匹配是第 match_chunk 块中的第 match_idx 个, match_chunk 为 -1 表示还没有定位
+    static int match_chunk = -1;
+    static long long match_idx = 0;
+
     if(key == '\r' || key == '\x1b'){
-        last_match = -1;
-        direction = 1;
+        searchCancel();
+        match_chunk = -1;
+        E.promptinfo[0] = '\0';
         return;
-    }else if(key == ARROW_RIGHT || key == ARROW_DOWN){
-        direction = 1;
-    }else if(key == ARROW_LEFT || key == ARROW_UP){
-        direction = -1;
-    }else{
-        last_match = -1;
-        direction = 1;
     }
 
-    if(last_match == -1) direction = 1;
-    int current = last_match;
+    searchjob* job = E.search.job;
+    if(!job || strcmp(job->query, query) != 0){
+        // 查询改变了, 重新开始查找
+        searchCancel();
+        match_chunk = -1;
+        E.promptinfo[0] = '\0';
+        if(query[0] == '\0') return;
+        searchStart(query);
+        job = E.search.job;
+    }
 
-    int i;
-    for(i=0; i<E.numrows; i++){
-        current += direction;
-        if(current == -1) 
-            current = E.numrows - 1;
-        else if(current == E.numrows) 
-            current = 0;
-
-        erow* row = &E.row[current];
-        char* match = strstr(row->render, query);
-
-        if(match){
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match-row->render);
-            E.rowoff = E.numrows;
-            break;
+    if(match_chunk == -1){
+        // 第一个匹配所在的块之前的块都完成后, 才能确定第一个匹配
+        int c;
+        for(c = 0; c < job->nchunks && searchChunkDone(job, c); c++){
+            if(job->chunks[c].nmatches > 0){
+                match_chunk = c;
+                match_idx = 0;
+                break;
+            }
+        }
+    }else if(key == ARROW_RIGHT || key == ARROW_DOWN){
+        if(++match_idx >= job->chunks[match_chunk].nmatches){
+            match_chunk = searchNextChunk(job, match_chunk + 1, 1);
+            match_idx = 0;
+        }
+    }else if(key == ARROW_LEFT || key == ARROW_UP){
+        if(--match_idx < 0){
+            match_chunk = searchNextChunk(job, match_chunk - 1, -1);
+            match_idx = job->chunks[match_chunk].nmatches - 1;
         }
     }
+
+    int complete;
+    long long total = searchCount(job, &complete);
+    if(match_chunk == -1){
+        snprintf(E.promptinfo, sizeof(E.promptinfo), complete ? "no match" : "searching...");
+        return;
+    }
+
+    long long k = match_idx + 1;
+    int c;
+    for(c = 0; c < match_chunk; c++)
+        k += job->chunks[c].nmatches;
+    snprintf(E.promptinfo, sizeof(E.promptinfo), "match %lld of %lld%s", k, total, complete ? "" : "+");
+
+    searchmatch* m = &job->chunks[match_chunk].matches[match_idx];
+    E.cy = m->row;
+    E.cx = m->col;
+    E.rowoff = E.numrows;
 }
 
 void editorFind(){
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
+    editorCloseGap();
+    long long saved_cx = E.cx;
+    long long saved_cy = E.cy;
+    long long saved_coloff = E.coloff;
+    long long saved_rowoff = E.rowoff;
 
-    char* query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+    char* query = editorPrompt("Search: %s (Use ESC/Arrows/Enter) %s", editorFindCallback);
 
     if(query){
         free(query);
@@ -590,30 +4590,221 @@ void editorFind(){
 
 
 
-/******************** append buffer ********************/
-struct abuf
+/******************** goto ********************/
+
+// 跳到第 line 行 (从 1 开始), 目标行显示在屏幕中间
+void editorGotoLine(long long line){
+    editorLoadRows(line);
+    E.cy = line < 1 ? 0 : line - 1;
+    if(E.cy >= E.numrows) E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+    E.cx = 0;
+    E.rowoff = E.cy > E.screenrows / 2 ? E.cy - E.screenrows / 2 : 0;
+}
+
+// 跳到字节偏移 off, 每行算上换行符
+void editorGotoOffset(long long off){
+    while(editorLoading() && ropeSum(E.rope) <= off)
+        editorLoadRows(E.numrows + QEDITOR_LOAD_CHUNK);
+    long long col;
+    editorGotoLine(ropeFindOffset(off, &col) + 1);
+    E.cx = col;
+}
+
+// 输入 N 跳到第 N 行, 输入 bN 跳到第 N 个字节, N 可以是 0x 开头的十六进制
+void editorGoto(){
+    char* query = editorPrompt("Go to line (bN for byte offset): %s", NULL);
+    if(query == NULL) return;
+
+    int byte = query[0] == 'b' || query[0] == 'B';
+    char* end;
+    long long n = strtoll(byte ? query + 1 : query, &end, byte ? 0 : 10);
+    if(end == (byte ? query + 1 : query) || *end != '\0' || n < 0)
+        editorSetStatusMessage("Invalid %s: %s", byte ? "offset" : "line number", query);
+    else if(byte)
+        editorGotoOffset(n);
+    else
+        editorGotoLine(n);
+    free(query);
+}
+
+/******************** append buffer ********************/
+#define ABUF_INIT {NULL, 0, 0}
+
+// 保证还能追加 n 个字节, 容量按倍数增长
+int abReserve(struct abuf *ab, int n)
+{
+    if (ab->len + n <= ab->cap)
+        return 0;
+    int cap = ab->cap * 2 > ab->len + n ? ab->cap * 2 : ab->len + n;
+    char *new = realloc(ab->b, cap);
+    E.prof.reallocs++;
+    if (new == NULL)
+        return -1;
+    ab->b = new;
+    ab->cap = cap;
+    return 0;
+}
+
+// append a string S to an abuf
+void abAppend(struct abuf *ab, const char *s, int len)
+{
+    if (len <= 0 || abReserve(ab, len) == -1)
+        return;
+    memcpy(&ab->b[ab->len], s, len); // copy the string S after the end of the current data
+    ab->len += len;
+}
+
+// 追加 n 个字符 c
+void abAppendFill(struct abuf *ab, int c, int n)
+{
+    if (n <= 0 || abReserve(ab, n) == -1)
+        return;
+    memset(&ab->b[ab->len], c, n);
+    ab->len += n;
+}
+
+// 追加渲染结果中从 E.coloff 列开始的一屏内容, 被左边界截断的宽字符用空格补齐
+void abAppendColumns(struct abuf *ab, const char *s, long long len)
+{
+    long long col = 0, i = 0;
+    int n = 0, w = 0, cp;
+    while (i < len)
+    {
+        n = utf8Decode(&s[i], len - i, &cp);
+        w = charWidth(cp);
+        if (col >= E.coloff && (E.coloff == 0 || w > 0))
+            break;
+        if (col + w > E.coloff)
+            break;
+        col += w;
+        i += n;
+    }
+    long long end = E.coloff + E.screencols;
+    if (i < len && col < E.coloff)
+    {
+        i += n;
+        col += w;
+        abAppendFill(ab, ' ', (int)((col < end ? col : end) - E.coloff));
+    }
+    long long start = i;
+    while (i < len)
+    {
+        n = utf8Decode(&s[i], len - i, &cp);
+        w = charWidth(cp);
+        if (col + w > end)
+            break;
+        col += w;
+        i += n;
+    }
+    abAppend(ab, &s[start], (int)(i - start));
+}
+
+void abFree(struct abuf *ab)
+{
+    free(ab->b);
+    ab->b = NULL;
+    ab->len = ab->cap = 0;
+}
+
+// 追加一行渲染结果中从 at 开始的 len 列, 不含制表符的行直接从 chars 的间隙两侧复制
+void abAppendRow(struct abuf *ab, erow *row, long long at, int len)
+{
+    if (len <= 0)
+        return;
+    if (!(row->flags & ROW_PLAIN))
+    {
+        abAppend(ab, &E.rcache[row->rslot].render[at], len);
+        return;
+    }
+    if (at < row->gap)
+    {
+        int n = row->gap - at < len ? (int)(row->gap - at) : len;
+        abAppend(ab, &row->chars[at], n);
+        at += n;
+        len -= n;
+    }
+    if (len > 0)
+        abAppend(ab, &row->chars[at + editorRowGapLen(row)], len);
+}
+
+/******************** profiling ********************/
+/*
+每帧记录 editorscroll、绘制和写终端各自的耗时, 以及输出的字节数和 abAppend 的扩容次数,
+再加上行内存和载入、保存的吞吐量。写终端慢而绘制快, 说明瓶颈在终端连接上。
+*/
+
+double profMBps(long long bytes, long long ns)
 {
-    char *b;
-    int len;
-};
-
-#define ABUF_INIT {NULL, 0};
+    return ns > 0 ? bytes / (ns / 1e9) / 1048576.0 : 0.0;
+}
 
-// append a string S to an abuf
-void abAppend(struct abuf *ab, const char *s, int len)
+double profAvgUs(long long total)
 {
-    char *new = realloc(ab->b, ab->len + len);
+    return E.prof.frames ? total / 1e3 / E.prof.frames : 0.0;
+}
 
-    if (new == NULL)
-        return;
-    memcpy(&new[ab->len], s, len); // copy the string S after the end of the current data
-    ab->b = new;
-    ab->len += len;
+// 覆盖层的第 i 行
+void editorDrawProfile(struct abuf *ab, int i)
+{
+    profstats *p = &E.prof;
+    char buf[256];
+    int len = 0;
+    switch (i)
+    {
+    case 0:
+        len = snprintf(buf, sizeof(buf),
+                       "frame %lld: scroll %.1fus draw %.1fus write %.1fus (avg %.1f/%.1f/%.1f)",
+                       p->frames, p->scrollns / 1e3, p->drawns / 1e3, p->writens / 1e3,
+                       profAvgUs(p->scrolltotal), profAvgUs(p->drawtotal), profAvgUs(p->writetotal));
+        break;
+    case 1:
+        len = snprintf(buf, sizeof(buf),
+                       "out %d B/frame (avg %.0f) | abAppend reallocs %d/frame (%lld total)",
+                       p->framebytes, p->frames ? (double)p->bytestotal / p->frames : 0.0,
+                       p->framereallocs, p->reallocs);
+        break;
+    default:
+        len = snprintf(buf, sizeof(buf),
+                       "rows %.1f MB live %.1f MB reserved | load %.1f MB/s | save %.1f MB/s",
+                       E.rowmem.live / 1048576.0, E.rowmem.reserved / 1048576.0,
+                       profMBps(p->loadbytes, p->loadns), profMBps(p->savebytes, p->savens));
+        break;
+    }
+    if (len > E.screencols)
+        len = E.screencols;
+    abAppend(ab, buf, len);
 }
 
-void abFree(struct abuf *ab)
+// 退出时把性能计数写入 --stats-file 指定的文件
+void editorWriteStats()
 {
-    free(ab->b);
+    profstats *p = &E.prof;
+    FILE *fp = fopen(E.statsfile, "w");
+    if (!fp)
+        return;
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"frames\": %lld,\n", p->frames);
+    fprintf(fp, "  \"scroll_ns_total\": %lld,\n", p->scrolltotal);
+    fprintf(fp, "  \"draw_ns_total\": %lld,\n", p->drawtotal);
+    fprintf(fp, "  \"write_ns_total\": %lld,\n", p->writetotal);
+    fprintf(fp, "  \"scroll_us_avg\": %.3f,\n", profAvgUs(p->scrolltotal));
+    fprintf(fp, "  \"draw_us_avg\": %.3f,\n", profAvgUs(p->drawtotal));
+    fprintf(fp, "  \"write_us_avg\": %.3f,\n", profAvgUs(p->writetotal));
+    fprintf(fp, "  \"bytes_written\": %lld,\n", p->bytestotal);
+    fprintf(fp, "  \"bytes_per_frame\": %.1f,\n", p->frames ? (double)p->bytestotal / p->frames : 0.0);
+    fprintf(fp, "  \"abappend_reallocs\": %lld,\n", p->reallocs);
+    fprintf(fp, "  \"row_allocator\": \"%s\",\n", E.rowalloc->name);
+    fprintf(fp, "  \"row_mem_live\": %zu,\n", E.rowmem.live);
+    fprintf(fp, "  \"row_mem_reserved\": %zu,\n", E.rowmem.reserved);
+    fprintf(fp, "  \"row_mem_peak\": %zu,\n", E.rowmem.peak);
+    fprintf(fp, "  \"load_bytes\": %lld,\n", p->loadbytes);
+    fprintf(fp, "  \"load_ns\": %lld,\n", p->loadns);
+    fprintf(fp, "  \"load_mb_per_s\": %.1f,\n", profMBps(p->loadbytes, p->loadns));
+    fprintf(fp, "  \"save_bytes\": %lld,\n", p->savebytes);
+    fprintf(fp, "  \"save_ns\": %lld,\n", p->savens);
+    fprintf(fp, "  \"save_mb_per_s\": %.1f\n", profMBps(p->savebytes, p->savens));
+    fprintf(fp, "}\n");
+    fclose(fp);
 }
 
 /******************** output ********************/
@@ -624,7 +4815,7 @@ void editorscroll()
     // 光标在有效行范围内
     if (E.cy < E.numrows)
     {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRow(E.cy), E.cx);
     }
 
     if (E.cy < E.rowoff)
@@ -635,6 +4826,7 @@ void editorscroll()
     {
         E.rowoff = E.cy - E.screenrows + 1;
     }
+    editorLoadRows(E.rowoff + E.screenrows);
     if (E.rx < E.coloff)
     {
         E.coloff = E.rx;
@@ -645,13 +4837,271 @@ void editorscroll()
     }
 }
 
-// 绘制屏幕上的每一行内容，并将绘制结果追加到字符缓冲区 abuf
-void editorDrawRows(struct abuf *ab)
+/*
+终端上显示的内容保存在 E.frame 中, 每次刷新只输出与上一帧不同的行,
+行首和行尾相同的部分也会跳过。
+
+一帧的输出由若干段组成: 转义序列写在 E.out 中, 行的内容不再复制, 直接引用 E.frame 中
+刚换入的缓冲区, 最后用一次 writev 写出。E.line、E.out 和 E.frame 的缓冲区都在各帧之间
+重复使用, 大小稳定后每帧不再分配内存。
+*/
+
+// 为当前的屏幕大小分配 E.frame, 并预留一帧输出需要的空间
+void editorFrameAlloc()
+{
+    E.frame = calloc(E.screenrows + 2, sizeof(frameline));
+    E.out.len = 0;
+    abReserve(&E.out, (E.screenrows + 2) * 48 + 64);
+    E.npieces = 0;
+    int cap = (E.screenrows + 2) * 4 + 8;
+    if (cap > E.piececap)
+    {
+        E.piececap = cap;
+        E.pieces = realloc(E.pieces, sizeof(outpiece) * cap);
+        E.iov = realloc(E.iov, sizeof(struct iovec) * cap);
+    }
+}
+
+void outPiece(const char *base, int off, int len)
+{
+    if (len <= 0)
+        return;
+    if (E.npieces > 0)
+    {
+        // E.out 中相邻的两段合并成一段
+        outpiece *last = &E.pieces[E.npieces - 1];
+        if (!base && !last->base && last->off + last->len == off)
+        {
+            last->len += len;
+            return;
+        }
+    }
+    if (E.npieces == E.piececap)
+    {
+        E.piececap *= 2;
+        E.pieces = realloc(E.pieces, sizeof(outpiece) * E.piececap);
+        E.iov = realloc(E.iov, sizeof(struct iovec) * E.piececap);
+    }
+    E.pieces[E.npieces].base = base;
+    E.pieces[E.npieces].off = off;
+    E.pieces[E.npieces].len = len;
+    E.npieces++;
+}
+
+// 输出转义序列等, 复制到 E.out 中
+void outAppend(const char *s, int len)
+{
+    int off = E.out.len;
+    abAppend(&E.out, s, len);
+    outPiece(NULL, off, len);
+}
+
+// 输出一段内容, 不复制; 在 outFlush 之前内容不能改变
+void outRef(const char *s, int len)
+{
+    outPiece(s, 0, len);
+}
+
+// 用一次 writev 写出这一帧, 返回写出的字节数; 回放时只统计字节数
+int outFlush()
+{
+    int total = 0;
+    int i;
+    for (i = 0; i < E.npieces; i++)
+    {
+        outpiece *p = &E.pieces[i];
+        E.iov[i].iov_base = (char *)(p->base ? p->base : &E.out.b[p->off]);
+        E.iov[i].iov_len = p->len;
+        total += p->len;
+    }
+    if (E.headless)
+    {
+        E.outbytes += total;
+    }
+    else
+    {
+        long long written = 0;
+        writevAll(STDOUT_FILENO, E.iov, E.npieces, &written);
+    }
+    E.npieces = 0;
+    E.out.len = 0;
+    return total;
+}
+
+// 内容是否全部是可打印的 ASCII 字符, 这样的内容每个字节占一列
+int frameAscii(const char *s, int len)
+{
+    int j;
+    for (j = 0; j < len; j++)
+    {
+        if (s[j] < 0x20 || s[j] > 0x7e)
+            return 0;
+    }
+    return 1;
+}
+
+// 把第 y 行的新内容与终端上的内容比较, 只输出发生变化的部分, 然后记住新内容
+void editorFrameUpdate(int y, struct abuf *line, int attr)
+{
+    frameline *old = &E.frame[y];
+    int same = E.framevalid && old->attr == attr;
+    if (same && old->len == line->len && (line->len == 0 || memcmp(old->b, line->b, line->len) == 0))
+    {
+        line->len = 0;
+        return;
+    }
+
+    int start = 0;
+    int end = line->len;
+    int clear = 1; // 是否需要清除新内容之后的部分
+    if (same)
+    {
+        int n = old->len < line->len ? old->len : line->len;
+        while (start < n && old->b[start] == line->b[start] &&
+               line->b[start] >= 0x20 && line->b[start] <= 0x7e)
+            start++;
+        if (old->len == line->len && frameAscii(&old->b[start], old->len - start) &&
+            frameAscii(&line->b[start], line->len - start))
+        {
+            while (end > start && old->b[end - 1] == line->b[end - 1])
+                end--;
+            clear = 0;
+        }
+    }
+
+    // 新内容换进 E.frame, 旧的缓冲区留给下一行绘制
+    char *b = old->b;
+    int cap = old->cap;
+    old->b = line->b;
+    old->cap = line->cap;
+    old->len = line->len;
+    old->attr = attr;
+    line->b = b;
+    line->cap = cap;
+    line->len = 0;
+
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, start + 1);
+    outAppend(buf, len);
+    if (attr)
+        outAppend("\x1b[7m", 4); // 反转颜色显示
+    outRef(&old->b[start], end - start);
+    if (attr)
+        outAppend("\x1b[m", 3); // 关闭反转颜色显示 默认0
+    if (clear)
+        outAppend("\x1b[K", 3); // 清除当前行的剩余部分
+}
+
+// 把 E.frame 中 [a, b) 的行倒序
+void frameReverse(int a, int b)
+{
+    for (b--; a < b; a++, b--)
+    {
+        frameline t = E.frame[a];
+        E.frame[a] = E.frame[b];
+        E.frame[b] = t;
+    }
+}
+
+// 文本区域上下滚动时, 用滚动区域 (DECSTBM) 和 SU/SD 让终端自己移动已经显示的行
+void editorFrameScroll()
+{
+    long long d = E.rowoff - E.framerowoff;
+    if (!E.framevalid || d == 0 || d >= E.screenrows || -d >= E.screenrows || E.coloff != E.framecoloff)
+        return;
+    int n = (int)(d > 0 ? d : -d);
+
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr", E.screenrows);
+    outAppend(buf, len);
+    len = snprintf(buf, sizeof(buf), d > 0 ? "\x1b[%dS" : "\x1b[%dT", n);
+    outAppend(buf, len);
+    outAppend("\x1b[r", 3);
+
+    // 文本区域的行向上或向下轮转 n 行, 移出屏幕的行的缓冲区用于新露出的行
+    int k = d > 0 ? n : E.screenrows - n;
+    frameReverse(0, k);
+    frameReverse(k, E.screenrows);
+    frameReverse(0, E.screenrows);
+    // 新露出的行在终端上是空白的
+    int j;
+    int blank = d > 0 ? E.screenrows - n : 0;
+    for (j = blank; j < blank + n; j++)
+    {
+        E.frame[j].len = 0;
+        E.frame[j].attr = 0;
+    }
+}
+
+// 带高亮地追加一行中从 E.coloff 列开始的一屏内容, 只分析到屏幕右边界附近
+void editorDrawHighlighted(struct abuf *ab, erow *row, int state)
+{
+    long long cx = editorRowRxToCx(row, E.coloff);
+    long long rx = editorRowCxToRx(row, cx);
+    long long end = E.coloff + E.screencols;
+    // 多分析一些, 跨过右边界的关键字也能被识别出来
+    long long limit = editorRowRxToCx(row, end) + 64;
+    if (limit > row->size)
+        limit = row->size;
+    if (limit > E.hlcap)
+    {
+        E.hlcap = limit > E.hlcap * 2 ? limit : E.hlcap * 2;
+        E.hl = realloc(E.hl, E.hlcap);
+    }
+    const char *s = editorSyntaxText(row);
+    editorSyntaxLex(s, limit, state, E.hl);
+
+    int color = 39; // 每行开始时是默认颜色
+    while (cx < limit)
+    {
+        int cp = (unsigned char)s[cx];
+        int n = cp < 0x80 ? 1 : utf8Decode(&s[cx], row->size - cx, &cp);
+        long long next = editorRowAdvance(row, cx, rx);
+        if (next > end)
+            break;
+        int c = editorSyntaxToColor(E.hl[cx]);
+        if (c != color)
+        {
+            char buf[16];
+            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", c);
+            abAppend(ab, buf, clen);
+            color = c;
+        }
+        if (s[cx] == '\t' || rx < E.coloff)
+        {
+            // 展开的制表符和被左边界截断的宽字符
+            abAppendFill(ab, ' ', (int)(next - (rx > E.coloff ? rx : E.coloff)));
+        }
+        else
+        {
+            abAppend(ab, &s[cx], n);
+        }
+        rx = next;
+        cx += n;
+    }
+    if (color != 39)
+        abAppend(ab, "\x1b[39m", 5);
+}
+
+// 绘制屏幕上的每一行内容，只把变化的部分追加到字符缓冲区 abuf
+void editorDrawRows()
 {
+    editorSyntaxSync(E.rowoff + E.screenrows);
     int y;
     for (y = 0; y < E.screenrows; y++)
     {
-        int filerow = y + E.rowoff;
+        struct abuf *line = &E.line;
+        line->len = 0;
+        long long filerow = y + E.rowoff;
+
+        // 性能信息覆盖在最后几行上, 反色显示
+        int prof = E.profoverlay ? y - (E.screenrows - QEDITOR_PROF_ROWS) : -1;
+        if (prof >= 0)
+        {
+            editorDrawProfile(line, prof);
+            editorFrameUpdate(y, line, 1);
+            continue;
+        }
 
         // 超出了文本文件的行数，表示需要绘制空行
         if (filerow >= E.numrows)
@@ -667,109 +5117,155 @@ void editorDrawRows(struct abuf *ab)
                 int padding = (E.screencols - welcomelen) / 2;
                 if (padding)
                 {
-                    abAppend(ab, "~", 1);
+                    abAppend(line, "~", 1);
                     padding--;
                 }
-                while (padding--)
-                    abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
+                abAppendFill(line, ' ', padding);
+                abAppend(line, welcome, welcomelen);
             }
             else
             {
-                abAppend(ab, "~", 1);
+                abAppend(line, "~", 1);
             }
         }
         // 未超出文本文件的行数，表示需要绘制实际的文本内容
         else
         {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0)
-                len = 0;
-            if (len > E.screencols)
-                len = E.screencols;
-
-            // 将当前行的渲染内容从列偏移量开始的指定长度 len 追加到字符缓冲区 abuf
-            abAppend(ab, &E.row[filerow].render[E.coloff], len);
+            erow *row = editorRow(filerow);
+            editorRowRender(row);
+            if (E.syntax)
+            {
+                editorDrawHighlighted(line, row, editorSyntaxState(filerow));
+            }
+            else if (row->flags & ROW_ASCII)
+            {
+                long long len = row->rsize - E.coloff;
+                if (len < 0)
+                    len = 0;
+                if (len > E.screencols)
+                    len = E.screencols;
+
+                // 将当前行的渲染内容从列偏移量开始的指定长度 len 追加到字符缓冲区 abuf
+                abAppendRow(line, row, E.coloff, (int)len);
+            }
+            else
+            {
+                abAppendColumns(line, editorRowRenderPtr(row), row->rsize);
+            }
         }
 
-        abAppend(ab, "\x1b[K", 3); // 清除当前行的部分内容
-        abAppend(ab, "\r\n", 2);
+        editorFrameUpdate(y, line, 0);
     }
 }
 
-void editorDrawStatusBar(struct abuf *ab)
+void editorDrawStatusBar()
 {
-    abAppend(ab, "\x1b[7m", 4); // 反转颜色显示
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+    struct abuf *line = &E.line;
+    line->len = 0;
+    char status[128], rstatus[128];
+    const char *mode = E.view.follow ? "(follow)" : E.view.on ? "(view)" : E.dirty ? "(modified)" : "";
+    int len = snprintf(status, sizeof(status), "%.20s - %lld%s lines %s",
                        E.filename ? E.filename : "[No Name]", E.numrows,
-                       E.dirty ? "(modified)": "");
-
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-                        E.cy + 1, E.numrows);
+                       editorLoading() ? "+" : "", mode);
+    if (E.save)
+        len += snprintf(status + len, sizeof(status) - len, " (saving %d%%)", editorSavePercent());
+    if (editorLoading() && editorLoadPercent() >= 0)
+        len += snprintf(status + len, sizeof(status) - len, " (loading %d%%)", editorLoadPercent());
+
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | byte %lld  %lld/%lld",
+                        E.syntax ? E.syntax->filetype : "no ft",
+                        ropeOffset(E.cy) + E.cx, E.cy + 1, E.numrows);
     if (len > E.screencols)
         len = E.screencols;
-    abAppend(ab, status, len);
+    abAppend(line, status, len);
 
-    while (len < E.screencols)
+    // 右侧信息放得下时靠右显示, 否则只用空格填满
+    if (E.screencols - len >= rlen)
     {
-        if (E.screencols - len == rlen)
-        {
-            abAppend(ab, rstatus, rlen);
-            break;
-        }
-        else
-        {
-            abAppend(ab, " ", 1);
-            len++;
-        }
+        abAppendFill(line, ' ', E.screencols - len - rlen);
+        abAppend(line, rstatus, rlen);
+    }
+    else
+    {
+        abAppendFill(line, ' ', E.screencols - len);
     }
-    abAppend(ab, "\x1b[m", 3); // 关闭反转颜色显示 默认0
-    abAppend(ab, "\r\n", 2);
+    editorFrameUpdate(E.screenrows, line, 1); // 状态栏反色显示
 }
 
-void editorDrawMessageBar(struct abuf *ab)
+void editorDrawMessageBar()
 {
-    abAppend(ab, "\x1b[K", 3);
+    struct abuf *line = &E.line;
+    line->len = 0;
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screencols)
         msglen = E.screencols;
     if (msglen && time(NULL) - E.statusmsg_time < 5)
-        abAppend(ab, E.statusmsg, msglen);
+        abAppend(line, E.statusmsg, msglen);
+    editorFrameUpdate(E.screenrows + 1, line, 0);
+}
+
+// 输出到终端; 回放时只统计字节数
+void editorWriteOut(const char *s, int len)
+{
+    if (E.headless)
+    {
+        E.outbytes += len;
+        return;
+    }
+    write(STDOUT_FILENO, s, len);
 }
 
 /*
-刷新屏幕显示。函数通过操作字符缓冲区 abuf 实现绘制并输出到屏幕上。
+刷新屏幕显示。函数通过操作字符缓冲区 abuf 实现绘制并输出到屏幕上,
+只输出与上一帧相比发生变化的内容。
 */
 
 void editorRefreshScreen()
 {
+    long long start = editorNowNs();
+    long long reallocs = E.prof.reallocs;
     editorscroll();
+    long long scrolled = editorNowNs();
 
-    struct abuf ab = ABUF_INIT;
     /*
     ?25l 是用于隐藏光标的控制码，其中：
         ? 表示参数序列的开始。
         25 是控制码的参数，表示光标的显示/隐藏。
         l 表示将参数应用到相应的设置，这里是将参数应用到光标显示/隐藏设置。
     */
-    abAppend(&ab, "\x1b[?25l", 6); // 隐藏光标
-    abAppend(&ab, "\x1b[H", 3);    // 将光标移动到屏幕的左上角位置
+    outAppend("\x1b[?25l", 6); // 隐藏光标
 
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    editorFrameScroll();
+    editorDrawRows();
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+    long long drawn = editorNowNs();
 
     char buf[32];
-    /*将光标位置信息格式化为字符串，并将其添加到缓冲区 ab 中*/
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
-
-    /*添加控制码 \x1b[?25h 到缓冲区 ab 中，用于恢复显示光标*/
-    abAppend(&ab, "\x1b[?25h", 6);
-
-    write(STDOUT_FILENO, ab.b, ab.len); // buffer's contents out to standard output
-    abFree(&ab);                        // free the memory
+    /*将光标位置信息格式化为字符串，并追加到这一帧的输出中*/
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (int)(E.cy - E.rowoff) + 1, (int)(E.rx - E.coloff) + 1);
+    outAppend(buf, len);
+
+    /*添加控制码 \x1b[?25h，用于恢复显示光标*/
+    outAppend("\x1b[?25h", 6);
+
+    E.framevalid = 1;
+    E.framerowoff = E.rowoff;
+    E.framecoloff = E.coloff;
+
+    int bytes = outFlush(); // 一次写出整帧
+
+    profstats *p = &E.prof;
+    p->frames++;
+    p->scrollns = scrolled - start;
+    p->drawns = drawn - scrolled;
+    p->writens = editorNowNs() - drawn;
+    p->scrolltotal += p->scrollns;
+    p->drawtotal += p->drawns;
+    p->writetotal += p->writens;
+    p->framebytes = bytes;
+    p->bytestotal += bytes;
+    p->framereallocs = E.prof.reallocs - reallocs;
 }
 
 // 设置编辑器状态栏中的消息
@@ -783,7 +5279,11 @@ void editorSetStatusMessage(const char *fmt, ...)
     va_end(ap);
 
     // 将当前时间（以秒为单位）存储在E.statusmsg_time
-    E.statusmsg_time = time(NULL);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    E.statusmsg_time = ts.tv_sec;
+    // 到 5 秒的边界时重绘, 让消息消失
+    editorSetTimer(TIMER_STATUSMSG, 5000 - ts.tv_nsec / 1000000 + 10);
 }
 
 /******************** input ********************/
@@ -795,12 +5295,15 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)){
     buf[0] = '\0';
 
     while(1){
-        editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
+        editorSetStatusMessage(prompt, buf, E.promptinfo);
+        if(!editorInputPending()) editorRefreshScreen();
 
         int c = editorReadKey();
         if(c==DEL_KEY || c== CTRL_KEY('h') || c==BACKSPACE){
-            if(buflen != 0) buf[--buflen] = '\0';
+            // 删除整个 UTF-8 字符
+            while(buflen != 0 && (buf[--buflen] & 0xc0) == 0x80)
+                ;
+            buf[buflen] = '\0';
         }else if(c == '\x1b'){
             editorSetStatusMessage("");
             if(callback) callback(buf, c);
@@ -812,7 +5315,19 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)){
                 if(callback) callback(buf, c);
                 return buf;
             }
-        }else if(!iscntrl(c) && c<128){
+        }else if(c == PASTE_TEXT){
+            // 粘贴到提示中时只取第一行
+            size_t i;
+            for(i = 0; i < E.pastelen && E.paste[i] != '\r' && E.paste[i] != '\n'; i++){
+                if((unsigned char)E.paste[i] < 128 && iscntrl((unsigned char)E.paste[i])) continue;
+                if(buflen == bufsize - 1){
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = E.paste[i];
+            }
+            buf[buflen] = '\0';
+        }else if((c < 128 && !iscntrl(c)) || (c >= 128 && c < 256)){
             if(buflen == bufsize - 1){
                 bufsize *= 2;
                 buf = realloc(buf, bufsize);
@@ -828,24 +5343,25 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)){
 // 处理光标移动
 void editorMoveCursor(int key)
 {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    editorLoadRows(E.cy + 1);
+    erow *row = editorRow(E.cy);
     switch (key)
     {
     case ARROW_LEFT:
         if (E.cx != 0)
         {
-            E.cx--;
+            E.cx = editorRowPrevCluster(row, E.cx);
         }
         else if (E.cy > 0)
         {
             E.cy--;
-            E.cx = E.row[E.cy].size;
+            E.cx = editorRow(E.cy)->size;
         }
         break;
     case ARROW_RIGHT:
         if (row && E.cx < row->size)
         {
-            E.cx++;
+            E.cx = editorRowNextCluster(row, E.cx);
         }
         else if (row && E.cx == row->size)
         {
@@ -867,25 +5383,91 @@ void editorMoveCursor(int key)
         break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-    int rowlen = row ? row->size : 0;
+    row = editorRow(E.cy);
+    long long rowlen = row ? row->size : 0;
     if (E.cx > rowlen)
     {
         E.cx = rowlen;
     }
+    // 换行后光标不能停在多字节字符的中间
+    if (E.cx < rowlen)
+        E.cx = editorRowCharStart(row, E.cx);
+}
+
+// 只读模式下的按键: 拒绝修改, 另外提供类似 less 的翻页键;
+// 返回交给 editorProcessKeypress 继续处理的按键, 0 表示已经处理完
+int editorViewKey(int c)
+{
+    switch (c)
+    {
+    case 'q':
+        return CTRL_KEY('q');
+    case ' ':
+    case 'f':
+        return PAGE_DOWN;
+    case 'b':
+        return PAGE_UP;
+    case 'j':
+        return ARROW_DOWN;
+    case 'k':
+        return ARROW_UP;
+    case '/':
+        return CTRL_KEY('f');
+    case 'g':
+        E.cy = E.cx = 0;
+        return 0;
+    case 'G':
+        // 跟随时光标停在最后一行就会随新的行移动
+        editorLoadAll();
+        E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+        E.cx = 0;
+        return 0;
+    // 只放行移动、查找、跳转和退出等不修改缓冲区的按键, 其余的都会走到插入或删除
+    case CTRL_KEY('q'):
+    case CTRL_KEY('f'):
+    case CTRL_KEY('g'):
+    case CTRL_KEY('t'):
+    case CTRL_KEY('p'):
+    case CTRL_KEY('l'):
+    case '\x1b':
+    case HOME_KEY:
+    case END_KEY:
+    case PAGE_UP:
+    case PAGE_DOWN:
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+        return c;
+    }
+    editorSetStatusMessage("Read-only: opened with --view");
+    return 0;
 }
 
 void editorProcessKeypress()
 {
     static int quit_times = QEDITOR_QUIT_TIMES;
 
+    int more = E.pasting; // 接着上一段读粘贴的内容, 整个粘贴作为一组撤销
     int c = editorReadKey();
+    if (c == BG_EVENT)
+        return;
+    if (E.view.on && !(c = editorViewKey(c)))
+        return;
+
+    if (!more)
+        editorUndoBegin();
     switch (c)
     {
+
     case '\r':
         editorInsertNewline();
         break;
 
+    case PASTE_TEXT:
+        editorInsertText(E.paste, E.pastelen);
+        break;
+
     case CTRL_KEY('q'):
         if(E.dirty && quit_times > 0){
             editorSetStatusMessage("WARNING!! File has unsaved changes." 
@@ -894,8 +5476,9 @@ void editorProcessKeypress()
             return;
         }
 
-        write(STDOUT_FILENO, "\x1b[2J", 4);
-        write(STDOUT_FILENO, "\x1b[H", 3);
+        editorSaveWait();
+        editorWriteOut("\x1b[2J", 4);
+        editorWriteOut("\x1b[H", 3);
         exit(0);
         break;
 
@@ -903,18 +5486,37 @@ void editorProcessKeypress()
         editorSave();
         break;
 
+    case CTRL_KEY('t'):
+        editorShowRowMem();
+        break;
+
+    case CTRL_KEY('p'):
+        E.profoverlay = !E.profoverlay;
+        break;
+
+    case CTRL_KEY('z'):
+        editorUndo();
+        break;
+    case CTRL_KEY('y'):
+        editorRedo();
+        break;
+
     case HOME_KEY:
         E.cx = 0;
         break;
     case END_KEY:
         if (E.cy < E.numrows)
-            E.cx = E.row[E.cy].size;
+            E.cx = editorRow(E.cy)->size;
         break;
     
     case CTRL_KEY('f'):
         editorFind();
         break;
 
+    case CTRL_KEY('g'):
+        editorGoto();
+        break;
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
@@ -932,6 +5534,7 @@ void editorProcessKeypress()
         }
         else if (c == PAGE_DOWN)
         {
+            editorLoadRows(E.rowoff + E.screenrows);
             E.cy = E.rowoff + E.screenrows - 1;
             if (E.cy > E.numrows)
                 E.cy = E.numrows;
@@ -950,6 +5553,9 @@ void editorProcessKeypress()
         break;
 
     case CTRL_KEY('l'):
+        E.framevalid = 0; // 下一帧完整重绘
+        break;
+
     case '\x1b':
         break;
 
@@ -958,6 +5564,7 @@ void editorProcessKeypress()
         editorInsertChar(c);
         break;
     }
+    editorUndoEnd();
 
     quit_times = QEDITOR_QUIT_TIMES;
 }
@@ -967,6 +5574,124 @@ void editorProcessKeypress()
 [ 表示控制码的开始
 */
 
+/******************** bench ********************/
+/*
+无终端回放: qeditor --bench 按键脚本 [--size 行x列] [文件]
+按键从脚本读入, 通过 editorProcessKeypress 处理, 每个按键之后刷新一帧, 输出只统计字节数。
+脚本可以用 --record 在正常编辑时录制。用 make bench 编译的版本还会统计内存分配次数。
+*/
+
+#ifdef QEDITOR_BENCH
+// 替换 libc 的分配函数, 计数后交给 glibc 的实现
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t m);
+extern void *__libc_realloc(void *p, size_t n);
+extern void __libc_free(void *p);
+long benchAllocs; // 原子访问, 后台线程也会分配
+
+void *malloc(size_t n)
+{
+    __atomic_add_fetch(&benchAllocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t m)
+{
+    __atomic_add_fetch(&benchAllocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, m);
+}
+
+void *realloc(void *p, size_t n)
+{
+    __atomic_add_fetch(&benchAllocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, n);
+}
+
+void free(void *p)
+{
+    __libc_free(p);
+}
+#define benchAllocCount() __atomic_load_n(&benchAllocs, __ATOMIC_RELAXED)
+#else
+#define benchAllocCount() (-1L)
+#endif
+
+void benchRecord(long long latency, int bytes, long allocs)
+{
+    benchstats *b = &E.bench;
+    if (b->n == b->cap)
+    {
+        b->cap = b->cap ? b->cap * 2 : 4096;
+        b->latency = realloc(b->latency, sizeof(long long) * b->cap);
+        b->bytes = realloc(b->bytes, sizeof(int) * b->cap);
+        b->allocs = realloc(b->allocs, sizeof(long) * b->cap);
+    }
+    b->latency[b->n] = latency;
+    b->bytes[b->n] = bytes;
+    b->allocs[b->n] = allocs;
+    b->n++;
+}
+
+int benchCmpLL(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+int benchCmpInt(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return x < y ? -1 : x > y;
+}
+
+// 程序退出时输出统计结果
+void benchReport()
+{
+    benchstats *b = &E.bench;
+    editorSaveWait();
+    if (b->n == 0)
+    {
+        fprintf(stderr, "bench: no keys replayed\n");
+        return;
+    }
+    long long total = 0;
+    long allocs = 0;
+    int i;
+    for (i = 0; i < b->n; i++)
+        allocs += b->allocs[i];
+    qsort(b->latency, b->n, sizeof(long long), benchCmpLL);
+    qsort(b->bytes, b->n, sizeof(int), benchCmpInt);
+    for (i = 0; i < b->n; i++)
+        total += b->bytes[i];
+
+    printf("keys        %d (%dx%d)\n", b->n, E.screenrows + 2, E.screencols);
+    printf("latency us  p50 %.1f  p99 %.1f  max %.1f\n",
+           b->latency[b->n / 2] / 1e3, b->latency[(long long)b->n * 99 / 100] / 1e3,
+           b->latency[b->n - 1] / 1e3);
+    printf("bytes/frame avg %.1f  p50 %d  p99 %d  max %d\n", (double)total / b->n,
+           b->bytes[b->n / 2], b->bytes[(long long)b->n * 99 / 100], b->bytes[b->n - 1]);
+    if (benchAllocCount() >= 0)
+        printf("allocations %ld (%.2f per key)\n", allocs, (double)allocs / b->n);
+    else
+        printf("allocations not counted (build with make bench)\n");
+    fflush(stdout);
+}
+
+// 回放按键脚本, 脚本读完时在 editorInputByte 中退出
+void benchRun()
+{
+    atexit(benchReport);
+    for (;;)
+    {
+        long long out = E.outbytes;
+        long allocs = benchAllocCount();
+        long long start = editorNowNs();
+        editorProcessKeypress();
+        editorRefreshScreen();
+        benchRecord(editorNowNs() - start, E.outbytes - out, benchAllocCount() - allocs);
+    }
+}
+
 /******************** init ********************/
 
 void initEditor()
@@ -976,33 +5701,143 @@ void initEditor()
     E.rx = 0;
     E.rowoff = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rope = NULL;
+    E.gaprow = NULL;
+    E.rcache = NULL;
+    E.rcachelen = 0;
+    E.rchand = 0;
+    memset(E.colcache, 0, sizeof(E.colcache));
+    E.colhand = 0;
+    E.framevalid = 0;
+    E.framerowoff = 0;
+    E.framecoloff = 0;
     E.dirty = 0;
     E.filename = NULL;
+    E.map = NULL;
+    E.mapsize = 0;
+    E.load = NULL;
+    E.view.fd = -1; // on 和 follow 已经由命令行参数设置
+    E.watching = 0;
+    E.watchfd = E.watchwd = -1;
+    E.watchpending = 0;
+    E.inpos = E.inlen = 0;
+    E.winch = 0;
+    memset(E.timers, 0, sizeof(E.timers));
+    if (pipe(E.wakefd) == -1)
+        die("pipe");
+    fcntl(E.wakefd[0], F_SETFL, O_NONBLOCK);
+    fcntl(E.wakefd[1], F_SETFL, O_NONBLOCK);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editorSigwinch;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
+    E.paste = NULL;
+    E.pastelen = E.pastecap = 0;
+    E.pasting = 0;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
 
-    if (getWindowSize2(&E.screenrows, &E.screencols) == -1)
+    if (E.headless)
+        ; // 虚拟终端的大小已经由命令行参数设置
+    else if (getWindowSize2(&E.screenrows, &E.screencols) == -1)
         die("getWindowSize");
 
     E.screenrows -= 2;
+
+    E.rcachelen = E.screenrows * 2 > QEDITOR_RENDER_CACHE ? E.screenrows * 2 : QEDITOR_RENDER_CACHE;
+    E.rcache = calloc(E.rcachelen, sizeof(rcacheslot));
+    editorFrameAlloc();
+    editorInitSearch();
+    E.search.nthreads = 0;
+    E.search.job = NULL;
+    E.search.busy = 0;
+    E.promptinfo[0] = '\0';
+    E.save = NULL;
+    E.gen = 1;
+    memset(&E.undo, 0, sizeof(E.undo));
+    memset(&E.rowmem, 0, sizeof(E.rowmem));
+    memset(E.slabfree, 0, sizeof(E.slabfree));
+    E.slabpage = E.arena = NULL;
+    E.slableft = E.arenaleft = 0;
+    editorInitRowAlloc();
+    char *limit = getenv("QEDITOR_UNDO_LIMIT");
+    E.undo.limit = limit ? strtoul(limit, NULL, 10) : QEDITOR_UNDO_LIMIT;
 }
 
 int main(int argc, char *argv[])
 {
-    enableRawMode();
+    char *filename = NULL;
+    char *script = NULL;
+    char *record = NULL;
+    E.screenrows = QEDITOR_BENCH_ROWS;
+    E.screencols = QEDITOR_BENCH_COLS;
+    int i;
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--bench") && i + 1 < argc)
+            script = argv[++i];
+        else if (!strcmp(argv[i], "--record") && i + 1 < argc)
+            record = argv[++i];
+        else if (!strcmp(argv[i], "--stats-file") && i + 1 < argc)
+            E.statsfile = argv[++i];
+        else if (!strcmp(argv[i], "--view"))
+            E.view.on = 1;
+        else if (!strcmp(argv[i], "--follow"))
+            E.view.on = E.view.follow = 1;
+        else if (!strcmp(argv[i], "--size") && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%dx%d", &E.screenrows, &E.screencols) != 2 ||
+                E.screenrows < 3 || E.screencols < 1)
+            {
+                fprintf(stderr, "bad size: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else
+            filename = argv[i];
+    }
+
+    E.infd = STDIN_FILENO;
+    E.recordfd = -1;
+    E.headless = script != NULL;
+    if (E.headless)
+    {
+        E.infd = open(script, O_RDONLY);
+        if (E.infd == -1)
+            die(script);
+    }
+    else
+    {
+        enableRawMode();
+    }
+    if (record)
+    {
+        E.recordfd = open(record, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (E.recordfd == -1)
+            die(record);
+    }
     initEditor();
-    if (argc >= 2)
+    if (E.statsfile)
+        atexit(editorWriteStats);
+    if (filename)
     {
-        editorOpen(argv[1]);
+        editorOpen(filename);
     }
+    if (E.headless)
+        benchRun();
 
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    if (E.view.on)
+        editorSetStatusMessage("HELP: q = quit | Space/b = page | / = find | g/G = top/end | Ctrl-G = goto");
+    else
+        editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-G = goto");
 
     // read keypresses from the user
     while (1)
     {
-        editorRefreshScreen();
+        // 输入都处理完才刷新, 连续的按键只重绘一次
+        if (!editorInputPending())
+            editorRefreshScreen();
         editorProcessKeypress();
     }
 